@@ -1,7 +1,10 @@
 // Buffer cache.
 //
 // The buffer cache is a linked list of buf structures holding
-// cached copies of disk block contents.  Caching disk blocks
+// cached copies of disk block contents.  Bufs come from a slab
+// cache: NBUF are allocated at boot, more are allocated when
+// every buf is in use, and the surplus is freed again as it is
+// released.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
 //
@@ -25,7 +28,8 @@
 
 struct {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct kcache *cache;
+  int nbuf;                // bufs currently allocated
 
   // Linked list of all buffers, through prev/next.
   // Sorted by how recently the buffer was used.
@@ -33,23 +37,44 @@ struct {
   struct buf head;
 } bcache;
 
+static struct buf* balloc(void);
+
 void
 binit(void)
 {
-  struct buf *b;
-
   initlock(&bcache.lock, "bcache");
+  bcache.cache = kcache_create("buf", sizeof(struct buf));
 
   // Create linked list of buffers
   bcache.head.prev = &bcache.head;
   bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
-  }
+  for(int i = 0; i < NBUF; i++)
+    if(balloc() == 0)
+      panic("binit");
+}
+
+// Allocate a new buf and add it to the tail of the LRU list.
+// Caller must hold bcache.lock, except during binit().
+// Returns 0 if out of memory.
+static struct buf*
+balloc(void)
+{
+  struct buf *b;
+
+  if((b = kcache_alloc(bcache.cache)) == 0)
+    return 0;
+  b->refcnt = 0;
+  b->dev = 0;
+  b->blockno = 0;
+  b->valid = 0;
+  b->disk = 0;
+  initsleeplock(&b->lock, "buffer");
+  b->prev = bcache.head.prev;
+  b->next = &bcache.head;
+  bcache.head.prev->next = b;
+  bcache.head.prev = b;
+  bcache.nbuf++;
+  return b;
 }
 
 // Look through buffer cache for block on device dev.
@@ -73,19 +98,21 @@ bget(uint dev, uint blockno)
   }
 
   // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
+  // Recycle the least recently used (LRU) unused buffer,
+  // or allocate another one if all of them are in use.
   for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
-    }
+    if(b->refcnt == 0)
+      break;
   }
-  panic("bget: no buffers");
+  if(b == &bcache.head && (b = balloc()) == 0)
+    panic("bget: no buffers");
+  b->dev = dev;
+  b->blockno = blockno;
+  b->valid = 0;
+  b->refcnt = 1;
+  release(&bcache.lock);
+  acquiresleep(&b->lock);
+  return b;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -112,7 +139,8 @@ bwrite(struct buf *b)
 }
 
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
+// Move to the head of the most-recently-used list,
+// or free it if the cache has grown beyond NBUF.
 void
 brelse(struct buf *b)
 {
@@ -127,6 +155,12 @@ brelse(struct buf *b)
     // no one is waiting for it.
     b->next->prev = b->prev;
     b->prev->next = b->next;
+    if(bcache.nbuf > NBUF){
+      bcache.nbuf--;
+      kcache_free(bcache.cache, b);
+      release(&bcache.lock);
+      return;
+    }
     b->next = bcache.head.next;
     b->prev = &bcache.head;
     bcache.head.next->prev = b;
@@ -0,0 +1,186 @@
+// Buddy allocator for physically contiguous runs of pages.
+//
+// Free memory is kept as blocks of 2^k pages, 0 <= k <= MAXORDER,
+// each aligned (relative to KERNBASE) to its own size. Allocating
+// an order-k block splits a larger block as needed; freeing one
+// merges it with its buddy (the other half of the order-k+1 block
+// it came from) for as long as the buddy is also free.
+//
+// kalloc.c layers its per-CPU page caches on top of this and
+// uses it as the global pool for single pages.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+
+#define MAXORDER 10   // largest block is 2^MAXORDER pages (4 MB)
+#define NPAGES   ((PHYSTOP - KERNBASE) / PGSIZE)
+
+// page index of a physical address, and back.
+#define PA2PG(pa) (((uint64)(pa) - KERNBASE) / PGSIZE)
+#define PG2PA(pg) (KERNBASE + (uint64)(pg) * PGSIZE)
+
+// state[pg] of the first page of a free block is BFREE|order;
+// every other page (allocated, or inside a free block) is 0.
+#define BFREE 0x80
+
+// free blocks are linked through their first page.
+struct block {
+  struct block *next;
+  struct block *prev;
+};
+
+struct {
+  struct spinlock lock;
+  struct block free[MAXORDER+1];  // circular lists; free[k] is the head
+  int nfree[MAXORDER+1];          // blocks on each list
+  uchar state[NPAGES];
+} buddy;
+
+static void
+addfree(struct block *b, int k)
+{
+  b->next = buddy.free[k].next;
+  b->prev = &buddy.free[k];
+  buddy.free[k].next->prev = b;
+  buddy.free[k].next = b;
+  buddy.state[PA2PG(b)] = BFREE | k;
+  buddy.nfree[k]++;
+}
+
+static void
+delfree(struct block *b, int k)
+{
+  b->prev->next = b->next;
+  b->next->prev = b->prev;
+  buddy.state[PA2PG(b)] = 0;
+  buddy.nfree[k]--;
+}
+
+// Hand the pages in [pa_start, pa_end) to the allocator, carved into
+// the largest aligned blocks that fit. No two of the resulting blocks
+// are mergeable buddies, so no coalescing is needed here.
+void
+buddyinit(void *pa_start, void *pa_end)
+{
+  uint64 pg, last;
+  int k;
+
+  initlock(&buddy.lock, "buddy");
+  for(k = 0; k <= MAXORDER; k++){
+    buddy.free[k].next = buddy.free[k].prev = &buddy.free[k];
+    buddy.nfree[k] = 0;
+  }
+
+  pg = PA2PG(PGROUNDUP((uint64)pa_start));
+  last = PA2PG(PGROUNDDOWN((uint64)pa_end));
+  while(pg < last){
+    for(k = MAXORDER; k > 0; k--)
+      if((pg & ((1L << k) - 1)) == 0 && pg + (1L << k) <= last)
+        break;
+    addfree((struct block*)PG2PA(pg), k);
+    pg += 1L << k;
+  }
+}
+
+// Remove a free block of exactly the given order, splitting a
+// larger one if necessary. Caller must hold buddy.lock.
+// Returns 0 if no block of that order or larger is free.
+static void *
+take(int order)
+{
+  struct block *b;
+  int k;
+
+  for(k = order; k <= MAXORDER; k++)
+    if(buddy.free[k].next != &buddy.free[k])
+      break;
+  if(k > MAXORDER)
+    return 0;
+
+  b = buddy.free[k].next;
+  delfree(b, k);
+  while(k > order){
+    // give back the upper half.
+    k--;
+    addfree((struct block*)((char*)b + (PGSIZE << k)), k);
+  }
+  return b;
+}
+
+// Return a block to the free lists, merging with free buddies.
+// Caller must hold buddy.lock.
+static void
+give(void *pa, int order)
+{
+  uint64 pg = PA2PG(pa);
+  uint64 bpg;
+
+  while(order < MAXORDER){
+    bpg = pg ^ (1L << order);
+    if(bpg + (1L << order) > NPAGES || buddy.state[bpg] != (BFREE | order))
+      break;
+    delfree((struct block*)PG2PA(bpg), order);
+    if(bpg < pg)
+      pg = bpg;
+    order++;
+  }
+  addfree((struct block*)PG2PA(pg), order);
+}
+
+// Allocate 2^order physically contiguous pages, aligned to
+// their size. Returns 0 if memory is too fragmented or exhausted.
+void *
+buddy_alloc(int order)
+{
+  void *pa;
+
+  if(order < 0 || order > MAXORDER)
+    return 0;
+  acquire(&buddy.lock);
+  pa = take(order);
+  release(&buddy.lock);
+  return pa;
+}
+
+// Free a block obtained from buddy_alloc(order). A block may
+// also be freed piecewise, as smaller aligned blocks.
+void
+buddy_free(void *pa, int order)
+{
+  if(order < 0 || order > MAXORDER || ((uint64)pa & ((PGSIZE << order) - 1)) != 0)
+    panic("buddy_free");
+  acquire(&buddy.lock);
+  if(buddy.state[PA2PG(pa)] & BFREE)
+    panic("buddy_free: double free");
+  give(pa, order);
+  release(&buddy.lock);
+}
+
+// Allocate up to n single pages into pa[] under one acquisition
+// of the lock. Returns the number of pages allocated.
+int
+buddy_alloc_batch(void **pa, int n)
+{
+  int i;
+
+  acquire(&buddy.lock);
+  for(i = 0; i < n; i++)
+    if((pa[i] = take(0)) == 0)
+      break;
+  release(&buddy.lock);
+  return i;
+}
+
+// Free n single pages from pa[] under one acquisition of the lock.
+void
+buddy_free_batch(void **pa, int n)
+{
+  acquire(&buddy.lock);
+  for(int i = 0; i < n; i++)
+    give(pa[i], 0);
+  release(&buddy.lock);
+}
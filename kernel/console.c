@@ -70,15 +70,19 @@ int console_write(int is_from_user_space, uint64 source_address, int total_bytes
 //
 // user read()s from the console go here.
 //
-int console_read(int is_to_user_space, uint64 dest_address, int max_bytes_to_read) {
+int console_read(int is_to_user_space, uint64 dest_address, int max_bytes_to_read, uint off) {
     if(console_buf.mode==CONSOLE_MODE_RAW){
         int fetch_char;char char_wrapped;
-        int read_bytes=0;
+        int read_bytes=0, copied;
         acquire(&console_buf.lock);
         while(console_buf.reader_idx<console_buf.editor_idx && max_bytes_to_read>0){
             fetch_char=console_buf.buf_data[console_buf.reader_idx++ % INPUT_BUF_SIZE];
             char_wrapped=fetch_char;
-            if(either_copyout(is_to_user_space, dest_address, &char_wrapped, 1)==-1) 
+            // copyout() may sleep, for the vmlock or a page fault.
+            release(&console_buf.lock);
+            copied=either_copyout(is_to_user_space, dest_address, &char_wrapped, 1);
+            acquire(&console_buf.lock);
+            if(copied==-1) 
                 break;
             dest_address++;read_bytes++;max_bytes_to_read--;
             if(fetch_char=='\n')
@@ -89,7 +93,7 @@ int console_read(int is_to_user_space, uint64 dest_address, int max_bytes_to_rea
     }
     else if(console_buf.mode==CONSOLE_MODE_CANONICAL){
         uint original_request_size = max_bytes_to_read;
-        int fetched_char;
+        int fetched_char, copied;
         char char_wrapper;  // Need addressable char for copyout
         acquire(&console_buf.lock);
         while (max_bytes_to_read > 0) {
@@ -117,9 +121,13 @@ int console_read(int is_to_user_space, uint64 dest_address, int max_bytes_to_rea
                 break;  // Return whatever we have read so far
             }
 
-            // Copy the character to user destination
+            // Copy the character to user destination, without the
+            // spinlock, since copyout() may sleep.
             char_wrapper = fetched_char;
-            if (either_copyout(is_to_user_space, dest_address, &char_wrapper, 1) == -1) break;
+            release(&console_buf.lock);
+            copied = either_copyout(is_to_user_space, dest_address, &char_wrapper, 1);
+            acquire(&console_buf.lock);
+            if (copied == -1) break;
 
             dest_address++;
             max_bytes_to_read--;
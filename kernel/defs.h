@@ -2,12 +2,15 @@ struct buf;
 struct context;
 struct file;
 struct inode;
+struct kcache;
 struct pipe;
 struct proc;
+struct shm;
 struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct vma;
 
 // bio.c
 void            binit(void);
@@ -25,6 +28,10 @@ void            consputc(int);
 // exec.c
 int             kexec(char*, char**);
 
+// fdt.c
+void            fdtinit(uint64);
+int             bootarg(char*, char*, int);
+
 // file.c
 struct file*    filealloc(void);
 void            fileclose(struct file*);
@@ -35,6 +42,12 @@ int             filestat(struct file*, uint64 addr);
 int             filewrite(struct file*, uint64, int n);
 int             fileioctl(struct file*, int, uint64);
 
+// futex.c
+void            futexinit(void);
+int             futexwait(uint64, int);
+int             futexwake(uint64, int);
+void            futexmoved(uint64);
+
 // fs.c
 void            fsinit(int);
 int             dirlink(struct inode*, char*, uint);
@@ -56,10 +69,23 @@ int             writei(struct inode*, int, uint64, uint, uint);
 void            itrunc(struct inode*);
 void            ireclaim(int);
 
+// buddy.c
+void            buddyinit(void*, void*);
+void*           buddy_alloc(int);
+void            buddy_free(void*, int);
+int             buddy_alloc_batch(void**, int);
+void            buddy_free_batch(void**, int);
+
 // kalloc.c
 void*           kalloc(void);
+void*           kalloc_zeroed(void);
+int             kzeroidle(void);
+void            krefinc(void*);
+int             krefcnt(void*);
 void            kfree(void *);
 void            kinit(void);
+void*           kalloc_pages(int);
+void            kfree_pages(void*, int);
 
 // log.c
 void            initlog(int, struct superblock*);
@@ -67,7 +93,14 @@ void            log_write(struct buf*);
 void            begin_op(void);
 void            end_op(void);
 
+// pagecache.c
+void            pagecacheinit(void);
+uint64          pagecache_get(struct inode*, uint, uint);
+void            pagecache_inval(uint, uint);
+int             pagecache_reclaim(void);
+
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, uint64, int);
@@ -79,9 +112,19 @@ void            panic(char*) __attribute__((noreturn));
 void            printfinit(void);
 
 // proc.c
+uint64          asidsatp(struct proc*);
+void            asidflush(struct proc*, uint64);
+void            asidsync(struct proc*);
+int             vmlock(struct proc*);
+void            vmunlock(struct proc*);
 int             cpuid(void);
 void            kexit(int);
 int             kfork(void);
+int             kclone(uint64, uint64, uint64);
+int             kjoin(int, uint64);
+void            killthreads(struct proc*);
+int             groupstop(struct proc*);
+void            groupresume(struct proc*);
 int             growproc(int);
 void            proc_mapstacks(pagetable_t);
 pagetable_t     proc_pagetable(struct proc *);
@@ -98,19 +141,43 @@ void            sleep(void*, struct spinlock*);
 void            userinit(void);
 int             kwait(uint64);
 void            wakeup(void*);
+int             wakeupn(void*, int);
+void            wakeuprange(void*, void*);
 void            yield(void);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
 void            procdump(void);
+int             schedtick(void);
+int             knice(int);
+int             ksetaffinity(int, uint64);
+uint64          kgetaffinity(int);
 
 // swtch.S
 void            swtch(struct context*, struct context*);
 
+// shm.c
+void            shminit(void);
+int             shmget(int, uint64);
+int             shmrm(int);
+uint64          shmat(struct proc*, int, uint64);
+int             shmdt(struct proc*, uint64);
+void            shmdup(struct shm*);
+void            shmput(struct shm*);
+
+// slab.c
+void            slabinit(void);
+struct kcache*  kcache_create(char*, uint);
+void*           kcache_alloc(struct kcache*);
+void            kcache_free(struct kcache*, void*);
+void*           kmalloc(uint);
+void            kmfree(void*);
+
 // spinlock.c
 void            acquire(struct spinlock*);
 int             holding(struct spinlock*);
 void            initlock(struct spinlock*, char*);
 void            release(struct spinlock*);
+void            lockstatinit(void);
 void            push_off(void);
 void            pop_off(void);
 
@@ -120,6 +187,13 @@ void            releasesleep(struct sleeplock*);
 int             holdingsleep(struct sleeplock*);
 void            initsleeplock(struct sleeplock*, char*);
 
+// swap.c
+void            swapinit(struct superblock*);
+void            swapdup(uint);
+void            swapfree(uint);
+void            swapread(uint, void*);
+void*           kalloc_user(int);
+
 // string.c
 int             memcmp(const void*, const void*, uint);
 void*           memmove(void*, const void*, uint);
@@ -137,8 +211,14 @@ int             fetchstr(uint64, char*, int);
 int             fetchaddr(uint64 addr, uint64* ip);
 void            syscall();
 
+// timer.c
+void            timerwheelinit(void);
+uint64          timerintr(uint64, uint64);
+int             timersleep(uint64);
+
 // trap.c
 extern uint     ticks;
+extern uint64   tickcycles;
 void            trapinit(void);
 void            trapinithart(void);
 extern struct spinlock tickslock;
@@ -160,16 +240,25 @@ pagetable_t     uvmcreate(void);
 uint64          uvmalloc(pagetable_t, uint64, uint64, int);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
 int             uvmcopy(pagetable_t, pagetable_t, uint64);
+uint64          uvmcow(pagetable_t, uint64);
 void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
 pte_t *         walk(pagetable_t, uint64, int);
 uint64          walkaddr(pagetable_t, uint64);
+uint64          userpa(pagetable_t, uint64, int, uint64*);
 int             copyout(pagetable_t, uint64, char *, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
 int             copyinstr(pagetable_t, char *, uint64, uint64);
 int             ismapped(pagetable_t, uint64);
 uint64          vmfault(pagetable_t, uint64, int);
+struct vma*     vmalookup(struct proc*, uint64);
+uint64          mmapbase(struct proc*);
+int             uvmadvise(struct proc*, uint64, uint64, int);
+uint64          uvmevict(struct proc*, uint);
+uint64          mmapalloc(struct proc*, uint64);
+int             vmacopy(struct proc*, struct proc*);
+void            vmaunmap(pagetable_t, struct vma*, uint64, uint64);
 
 // plic.c
 void            plicinit(void);
@@ -180,6 +269,7 @@ void            plic_complete(int);
 // virtio_disk.c
 void            virtio_disk_init(void);
 void            virtio_disk_rw(struct buf *, int);
+void            virtio_disk_rwpage(void*, uint, int);
 void            virtio_disk_intr(void);
 
 // number of elements in fixed-size array
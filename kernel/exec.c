@@ -6,8 +6,8 @@
 #include "proc.h"
 #include "defs.h"
 #include "elf.h"
-
-static int loadseg(pde_t *, uint64, struct inode *, uint, uint);
+#include "fcntl.h"
+#include "vm.h"
 
 // map ELF permissions to PTE permission bits.
 int flags2perm(int flags)
@@ -21,20 +21,30 @@ int flags2perm(int flags)
 }
 
 //
-// the implementation of the exec() system call
+// the implementation of the exec() system call.
+// program segments are not read here: each one is
+// recorded as a VMA, and vmfault() reads its pages
+// from the executable when they are first touched.
+// only a process's first thread may exec; it ends the
+// others once the new image is ready.
 //
 int
 kexec(char *path, char **argv)
 {
   char *s, *last;
-  int i, off;
+  int i, off, nvma = 0;
   uint64 argc, sz = 0, sp, ustack[MAXARG], stackbase;
   struct elfhdr elf;
   struct inode *ip;
   struct proghdr ph;
+  struct vma vma[NVMA];
   pagetable_t pagetable = 0, oldpagetable;
   struct proc *p = myproc();
 
+  if(p != p->group)
+    return -1;
+
+  memset(vma, 0, sizeof(vma));
   begin_op();
 
   // Open the executable file.
@@ -55,7 +65,7 @@ kexec(char *path, char **argv)
   if((pagetable = proc_pagetable(p)) == 0)
     goto bad;
 
-  // Load program into memory.
+  // Map the program's segments.
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, 0, (uint64)&ph, off, sizeof(ph)) != sizeof(ph))
       goto bad;
@@ -67,19 +77,27 @@ kexec(char *path, char **argv)
       goto bad;
     if(ph.vaddr % PGSIZE != 0)
       goto bad;
-    uint64 sz1;
-    if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz, flags2perm(ph.flags))) == 0)
+    if(ph.vaddr < sz || ph.vaddr + ph.memsz >= MMAPTOP)
+      goto bad;
+    if(ph.off + ph.filesz < ph.off)
       goto bad;
-    sz = sz1;
-    if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    if(nvma >= NVMA)
       goto bad;
+    vma[nvma].start = ph.vaddr;
+    vma[nvma].end = ph.vaddr + ph.memsz;
+    vma[nvma].perm = flags2perm(ph.flags);
+    vma[nvma].flags = MAP_PRIVATE;
+    vma[nvma].off = ph.off;
+    vma[nvma].filesz = ph.filesz;
+    vma[nvma].ip = idup(ip);
+    nvma++;
+    sz = ph.vaddr + ph.memsz;
   }
   iunlockput(ip);
   end_op();
   ip = 0;
 
   p = myproc();
-  uint64 oldsz = p->sz;
 
   // Allocate some pages at the next page boundary.
   // Make the first inaccessible as a stack guard.
@@ -127,47 +145,37 @@ kexec(char *path, char **argv)
       last = s+1;
   safestrcpy(p->name, last, sizeof(p->name));
     
-  // Commit to the user image.
+  // Commit to the user image, without the other threads.
+  killthreads(p);
+  uint64 oldsz = p->sz;
   oldpagetable = p->pagetable;
   p->pagetable = pagetable;
   p->sz = sz;
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
+  for(i = 0; i < NVMA; i++){
+    if(p->vma[i].flags)
+      vmaunmap(oldpagetable, &p->vma[i], p->vma[i].start, p->vma[i].end);
+  }
   proc_freepagetable(oldpagetable, oldsz);
+  memmove(p->vma, vma, sizeof(vma));
+  p->heapadvice = MADV_NORMAL;
+  p->faultnext = 0;
+  p->faultwin = 0;
+  p->swaphand = 0;
+  asidflush(p, -1);  // the ASID's TLB entries are for the old page table
 
   return argc; // this ends up in a0, the first argument to main(argc, argv)
 
  bad:
   if(pagetable)
     proc_freepagetable(pagetable, sz);
-  if(ip){
+  if(ip)
     iunlockput(ip);
-    end_op();
-  }
+  else
+    begin_op();
+  for(i = 0; i < nvma; i++)
+    iput(vma[i].ip);
+  end_op();
   return -1;
 }
-
-// Load an ELF program segment into pagetable at virtual address va.
-// va must be page-aligned
-// and the pages from va to va+sz must already be mapped.
-// Returns 0 on success, -1 on failure.
-static int
-loadseg(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset, uint sz)
-{
-  uint i, n;
-  uint64 pa;
-
-  for(i = 0; i < sz; i += PGSIZE){
-    pa = walkaddr(pagetable, va + i);
-    if(pa == 0)
-      panic("loadseg: address should exist");
-    if(sz - i < PGSIZE)
-      n = sz - i;
-    else
-      n = PGSIZE;
-    if(readi(ip, 0, (uint64)pa, offset+i, n) != n)
-      return -1;
-  }
-  
-  return 0;
-}
@@ -0,0 +1,100 @@
+// Boot arguments, from the flattened device tree.
+//
+// qemu passes each hart the address of a device tree that
+// describes the machine, and puts its -append string in the
+// tree's /chosen node as the bootargs property. fdtinit() copies
+// that string out before kinit() frees the memory the tree is in,
+// and bootarg() looks up name=value words in it.
+
+#include "types.h"
+#include "param.h"
+#include "riscv.h"
+#include "defs.h"
+
+#define FDT_MAGIC      0xd00dfeed
+#define FDT_BEGIN_NODE 1
+#define FDT_END_NODE   2
+#define FDT_PROP       3
+#define FDT_NOP        4
+#define FDT_END        9
+
+static char bootargs[128];
+
+// device tree numbers are big-endian.
+static uint
+be32(uint64 a)
+{
+  uchar *p = (uchar*)a;
+  return ((uint)p[0] << 24) | ((uint)p[1] << 16) | ((uint)p[2] << 8) | p[3];
+}
+
+// Copy /chosen/bootargs out of the device tree at fdt.
+// Ignores anything that doesn't look like a device tree.
+void
+fdtinit(uint64 fdt)
+{
+  uint64 p, end, strings;
+  uint len;
+  int depth = 0, chosen = 0;
+
+  if(fdt == 0 || be32(fdt) != FDT_MAGIC)
+    return;
+  p = fdt + be32(fdt + 8);
+  end = p + be32(fdt + 36);
+  strings = fdt + be32(fdt + 12);
+
+  while(p < end){
+    switch(be32(p)){
+    case FDT_BEGIN_NODE:
+      p += 4;
+      depth++;
+      if(depth == 2)
+        chosen = strncmp((char*)p, "chosen", 7) == 0;
+      p += (strlen((char*)p) + 1 + 3) & ~3;
+      break;
+    case FDT_END_NODE:
+      p += 4;
+      depth--;
+      break;
+    case FDT_PROP:
+      len = be32(p + 4);
+      if(depth == 2 && chosen && strncmp((char*)(strings + be32(p + 8)), "bootargs", 9) == 0){
+        safestrcpy(bootargs, (char*)(p + 12), len < sizeof(bootargs) ? len + 1 : sizeof(bootargs));
+        return;
+      }
+      p += 12 + ((len + 3) & ~3);
+      break;
+    case FDT_NOP:
+      p += 4;
+      break;
+    default:
+      return;
+    }
+  }
+}
+
+// Copy the value of boot argument name (from a name=value
+// word of the boot arguments) into buf, which holds n bytes.
+// returns the value's length, or -1 if there is no such argument.
+int
+bootarg(char *name, char *buf, int n)
+{
+  char *s = bootargs;
+  int k = strlen(name), i;
+
+  while(*s){
+    while(*s == ' ')
+      s++;
+    if(strncmp(s, name, k) == 0 && s[k] == '='){
+      s += k + 1;
+      for(i = 0; s[i] && s[i] != ' '; i++)
+        if(i < n - 1)
+          buf[i] = s[i];
+      buf[i < n - 1 ? i : n - 1] = 0;
+      return i;
+    }
+    while(*s && *s != ' ')
+      s++;
+  }
+  return -1;
+}
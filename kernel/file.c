@@ -14,27 +14,26 @@
 #include "file.h"
 
 struct devsw devsw[NDEV];
+// File structures come from the file cache; the lock
+// protects their reference counts.
 struct {
     struct spinlock lock;
-    struct file file[NFILE];
+    struct kcache *cache;
 } ftable;
 
-void fileinit(void) { initlock(&ftable.lock, "ftable"); }
+void fileinit(void) {
+    initlock(&ftable.lock, "ftable");
+    ftable.cache = kcache_create("file", sizeof(struct file));
+}
 
 // Allocate a file structure.
 struct file *filealloc(void) {
     struct file *f;
 
-    acquire(&ftable.lock);
-    for (f = ftable.file; f < ftable.file + NFILE; f++) {
-        if (f->ref == 0) {
-            f->ref = 1;
-            release(&ftable.lock);
-            return f;
-        }
-    }
-    release(&ftable.lock);
-    return 0;
+    if ((f = kcache_alloc(ftable.cache)) == 0) return 0;
+    memset(f, 0, sizeof(*f));
+    f->ref = 1;
+    return f;
 }
 
 // Increment ref count for file f.
@@ -57,9 +56,8 @@ void fileclose(struct file *f) {
         return;
     }
     ff = *f;
-    f->ref = 0;
-    f->type = FD_NONE;
     release(&ftable.lock);
+    kcache_free(ftable.cache, f);
 
     if (ff.type == FD_PIPE) {
         pipeclose(ff.pipe, ff.writable);
@@ -97,11 +95,15 @@ int fileread(struct file *f, uint64 addr, int n) {
         r = piperead(f->pipe, addr, n);
     } else if (f->type == FD_DEVICE) {
         if (f->major < 0 || f->major >= NDEV || !devsw[f->major].read) return -1;
-        r = devsw[f->major].read(1, addr, n);
+        if ((r = devsw[f->major].read(1, addr, n, f->off)) > 0) f->off += r;
     } else if (f->type == FD_INODE) {
+        // readi()'s copyout() takes the vmlock, which goes
+        // before the inode lock; see vmfault().
+        int locked = vmlock(myproc());
         ilock(f->ip);
         if ((r = readi(f->ip, 1, addr, f->off, n)) > 0) f->off += r;
         iunlock(f->ip);
+        if (locked) vmunlock(myproc());
     } else {
         panic("fileread");
     }
@@ -128,6 +130,7 @@ int filewrite(struct file *f, uint64 addr, int n) {
         // and 2 blocks of slop for non-aligned writes.
         int max = ((MAXOPBLOCKS - 1 - 1 - 2) / 2) * BSIZE;
         int i = 0;
+        int locked = vmlock(myproc());  // as in fileread()
         while (i < n) {
             int n1 = n - i;
             if (n1 > max) n1 = max;
@@ -144,6 +147,7 @@ int filewrite(struct file *f, uint64 addr, int n) {
             }
             i += r;
         }
+        if (locked) vmunlock(myproc());
         ret = (i == n ? n : -1);
     } else {
         panic("filewrite");
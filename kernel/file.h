@@ -18,6 +18,7 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  struct inode *next; // itable hash chain
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
 
@@ -31,7 +32,7 @@ struct inode {
 
 // map major device number to device functions.
 struct devsw {
-  int (*read)(int, uint64, int);
+  int (*read)(int, uint64, int, uint);  // the last is the file offset
   int (*write)(int, uint64, int);
   int (*ioctl)(int request, uint64 uaddr);
 };
@@ -39,3 +40,4 @@ struct devsw {
 extern struct devsw devsw[];
 
 #define CONSOLE 1
+#define LOCKSTAT 2
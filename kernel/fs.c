@@ -45,6 +45,7 @@ fsinit(int dev) {
     panic("invalid file system");
   initlog(dev, &sb);
   ireclaim(dev);
+  swapinit(&sb);
 }
 
 // Zero a block.
@@ -165,29 +166,33 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The itable.lock spin-lock protects the allocation of itable
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold itable.lock while using any of those fields.
+// In-memory inodes are allocated from a slab cache by iget() and
+// freed by iput() when the last reference goes away; the table is
+// a hash on inum of the inodes currently in use.
+//
+// The itable.lock spin-lock protects the hash chains and the
+// allocation of table entries. Since ip->ref indicates whether an
+// entry is in use, and ip->dev and ip->inum indicate which i-node
+// an entry holds, one must hold itable.lock while using any of
+// those fields.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
+#define NIHASH 31  // itable hash buckets
+
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct kcache *cache;
+  struct inode *hash[NIHASH];
 } itable;
 
 void
 iinit()
 {
-  int i = 0;
-  
   initlock(&itable.lock, "itable");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&itable.inode[i].lock, "inode");
-  }
+  itable.cache = kcache_create("inode", sizeof(struct inode));
 }
 
 static struct inode* iget(uint dev, uint inum);
@@ -247,31 +252,31 @@ iupdate(struct inode *ip)
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip;
+  struct inode **bucket = &itable.hash[inum % NIHASH];
 
   acquire(&itable.lock);
 
   // Is the inode already in the table?
-  empty = 0;
-  for(ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
+  for(ip = *bucket; ip; ip = ip->next){
+    if(ip->dev == dev && ip->inum == inum){
       ip->ref++;
       release(&itable.lock);
       return ip;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
   }
 
-  // Recycle an inode entry.
-  if(empty == 0)
+  // Allocate a new entry.
+  if((ip = kcache_alloc(itable.cache)) == 0)
     panic("iget: no inodes");
 
-  ip = empty;
+  initsleeplock(&ip->lock, "inode");
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->next = *bucket;
+  *bucket = ip;
   release(&itable.lock);
 
   return ip;
@@ -328,8 +333,8 @@ iunlock(struct inode *ip)
 }
 
 // Drop a reference to an in-memory inode.
-// If that was the last reference, the inode table entry can
-// be recycled.
+// If that was the last reference, the inode table entry is
+// freed.
 // If that was the last reference and the inode has no links
 // to it, free the inode (and its content) on disk.
 // All calls to iput() must be inside a transaction in
@@ -358,7 +363,13 @@ iput(struct inode *ip)
     acquire(&itable.lock);
   }
 
-  ip->ref--;
+  if(--ip->ref == 0){
+    struct inode **pp = &itable.hash[ip->inum % NIHASH];
+    while(*pp != ip)
+      pp = &(*pp)->next;
+    *pp = ip->next;
+    kcache_free(itable.cache, ip);
+  }
   release(&itable.lock);
 }
 
@@ -452,6 +463,8 @@ itrunc(struct inode *ip)
   struct buf *bp;
   uint *a;
 
+  pagecache_inval(ip->dev, ip->inum);
+
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
       bfree(ip->dev, ip->addrs[i]);
@@ -491,16 +504,23 @@ stati(struct inode *ip, struct stat *st)
 // Caller must hold ip->lock.
 // If user_dst==1, then dst is a user virtual address;
 // otherwise, dst is a kernel address.
+//
+// A copy to user memory can fault in a mapping of this very
+// file, which reads its blocks, so it goes through a bounce
+// buffer after the block's buf is released, not from the buf.
 int
 readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 {
   uint tot, m;
   struct buf *bp;
+  char *bounce = 0;
 
   if(off > ip->size || off + n < off)
     return 0;
   if(off + n > ip->size)
     n = ip->size - off;
+  if(user_dst && n > 0 && (bounce = kmalloc(BSIZE)) == 0)
+    return -1;
 
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
     uint addr = bmap(ip, off/BSIZE);
@@ -508,13 +528,20 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
       break;
     bp = bread(ip->dev, addr);
     m = min(n - tot, BSIZE - off%BSIZE);
-    if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
+    if(user_dst){
+      memmove(bounce, bp->data + (off % BSIZE), m);
+      brelse(bp);
+      if(either_copyout(1, dst, bounce, m) == -1){
+        tot = -1;
+        break;
+      }
+    } else {
+      memmove((char*)dst, bp->data + (off % BSIZE), m);
       brelse(bp);
-      tot = -1;
-      break;
     }
-    brelse(bp);
   }
+  if(bounce)
+    kmfree(bounce);
   return tot;
 }
 
@@ -525,30 +552,40 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 // Returns the number of bytes successfully written.
 // If the return value is less than the requested n,
 // there was an error of some kind.
+// Copies from user memory go through a bounce buffer,
+// as in readi().
 int
 writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
 {
   uint tot, m;
   struct buf *bp;
+  char *bounce = 0;
 
   if(off > ip->size || off + n < off)
     return -1;
   if(off + n > MAXFILE*BSIZE)
     return -1;
+  if(user_src && n > 0 && (bounce = kmalloc(BSIZE)) == 0)
+    return -1;
 
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
     uint addr = bmap(ip, off/BSIZE);
     if(addr == 0)
       break;
-    bp = bread(ip->dev, addr);
     m = min(n - tot, BSIZE - off%BSIZE);
-    if(either_copyin(bp->data + (off % BSIZE), user_src, src, m) == -1) {
-      brelse(bp);
+    if(user_src && either_copyin(bounce, 1, src, m) == -1)
       break;
-    }
+    bp = bread(ip->dev, addr);
+    memmove(bp->data + (off % BSIZE), user_src ? bounce : (char*)src, m);
     log_write(bp);
     brelse(bp);
   }
+  if(bounce)
+    kmfree(bounce);
+
+  // after the copies, which may have faulted pages of this
+  // file into the page cache as they were before the write.
+  pagecache_inval(ip->dev, ip->inum);
 
   if(off > ip->size)
     ip->size = off;
@@ -678,8 +715,13 @@ namex(char *path, int nameiparent, char *name)
 
   if(*path == '/')
     ip = iget(ROOTDEV, ROOTINO);
-  else
-    ip = idup(myproc()->cwd);
+  else {
+    // another thread may chdir() meanwhile; see sys_chdir().
+    struct proc *g = myproc()->group;
+    acquire(&g->lock);
+    ip = idup(g->cwd);
+    release(&g->lock);
+  }
 
   while((path = skipelem(path, name)) != 0){
     ilock(ip);
@@ -0,0 +1,109 @@
+// Futexes: sleeping on a word of user memory.
+//
+// futex_wait(addr, val) sleeps only if the int at addr still
+// holds val, and futex_wake(addr, n) wakes up to n processes
+// waiting on it, so that user-space locks (see user/ulib.c) need
+// the kernel only when a thread has to wait. A futex is named by
+// the physical address of its word, so that the threads of a
+// process and processes sharing memory (shmat(), MAP_SHARED)
+// meet at the same futex wherever they map it; that address is
+// the sleep channel.
+//
+// The word's page is made writable before its address is taken,
+// so that a copy-on-write copy made earlier can't move it. A fork
+// while a thread waits makes it copy-on-write again, and the next
+// write moves it, so uvmcow() wakes the waiters on the old page to
+// look again; a waiter must expect to be woken for nothing anyway.
+// A waiter doesn't set p->swapok, so that its page can't be paged
+// out; swap passes over pages shared with another process anyway.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+
+// the condition lock of every futex: the value check in
+// futexwait() and the wakeup in futexwake() are atomic
+// with respect to each other.
+static struct spinlock futexlock;
+
+void
+futexinit(void)
+{
+  initlock(&futexlock, "futex");
+}
+
+// The physical address of the futex word at user address
+// addr of the current process. Caller must hold its vmlock.
+// returns 0 if addr is not an aligned, writable int.
+static uint64
+futexaddr(uint64 addr)
+{
+  uint64 n;
+
+  if(addr % sizeof(int) != 0)
+    return 0;
+  return userpa(myproc()->pagetable, addr, 1, &n);
+}
+
+// Sleep until a futexwake() on addr, if the int there is val.
+// returns 0 when woken, or -1 if the int isn't val, addr is
+// bad, or the process was killed.
+int
+futexwait(uint64 addr, int val)
+{
+  struct proc *p = myproc();
+  uint64 pa;
+  int v;
+
+  vmlock(p);
+  if((pa = futexaddr(addr)) == 0){
+    vmunlock(p);
+    return -1;
+  }
+  // load the value under futexlock, and while the vmlock keeps
+  // munmap() and shmdt() from freeing the page.
+  acquire(&futexlock);
+  v = __atomic_load_n((int*)pa, __ATOMIC_SEQ_CST);
+  vmunlock(p);
+  if(v != val || killed(p)){
+    release(&futexlock);
+    return -1;
+  }
+  sleep((void*)pa, &futexlock);
+  release(&futexlock);
+  return killed(p) ? -1 : 0;
+}
+
+// Wake up to n processes waiting on the futex at addr.
+// returns how many were woken, or -1 if addr is bad.
+int
+futexwake(uint64 addr, int n)
+{
+  struct proc *p = myproc();
+  uint64 pa;
+
+  vmlock(p);
+  pa = futexaddr(addr);
+  vmunlock(p);
+  if(pa == 0)
+    return -1;
+  acquire(&futexlock);
+  n = wakeupn((void*)pa, n);
+  release(&futexlock);
+  return n;
+}
+
+// uvmcow() has given a copy of the page at pa to a page table
+// that maps it: wake all waiters on futexes in the page, since
+// some may be in that page table, their words now elsewhere.
+void
+futexmoved(uint64 pa)
+{
+  acquire(&futexlock);
+  wakeuprange((void*)pa, (void*)(pa + PGSIZE));
+  release(&futexlock);
+}
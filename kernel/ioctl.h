@@ -3,6 +3,7 @@
 #define CONSOLE_GET_ECHO 0x3    // Example ioctl request to clear the console screen
 #define CONSOLE_SET_ECHO 0x4  // Example ioctl request to set cursor position
 #define CONSOLE_DUMP_PROC 0x5   // Dump process list
+#define LOCKSTAT_RESET 0x10     // Zero the lockstat device's counters
 
 //Mode value
 #define CONSOLE_MODE_CANONICAL 0
@@ -1,6 +1,24 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers. Allocates whole 4096-byte pages,
+// or physically contiguous runs of 2^order pages.
+//
+// The global pool is the buddy allocator in buddy.c. Each CPU
+// keeps a private cache of free single pages in front of it, so
+// most kalloc()/kfree() calls only touch the calling CPU's list.
+// Pages move between a CPU cache and the buddy allocator KBATCH
+// at a time; a CPU whose cache and the buddy allocator are both
+// out of pages steals half of another CPU's cache.
+//
+// Pages are only filled with junk on kfree() and kalloc() in
+// POISON builds; otherwise kalloc() returns whatever the page
+// last held, and callers that need zeros use kalloc_zeroed().
+// Idle CPUs keep a pool of up to KZMAX already-zeroed pages
+// (see kzeroidle()) that kalloc_zeroed() takes from first.
+//
+// Every page handed out by kalloc() has a reference count, so
+// that fork can share pages copy-on-write; kfree() drops one
+// reference and only frees the page when the last one goes.
 
 #include "types.h"
 #include "param.h"
@@ -9,57 +27,208 @@
 #include "riscv.h"
 #include "defs.h"
 
-void freerange(void *pa_start, void *pa_end);
+#define KBATCH 32          // pages moved per refill or spill
+#define KHIGH  (2*KBATCH)  // spill once a CPU cache holds more than this
+#define KZMAX  256         // pages in the pre-zeroed pool
 
 extern char end[]; // first address after kernel.
                    // defined by kernel.ld.
 
+#ifdef POISON
+#define junk(pa, c, n) memset((pa), (c), (n))
+#else
+#define junk(pa, c, n)
+#endif
+
 struct run {
   struct run *next;
 };
 
+// reference counts of single pages from kalloc(), indexed by
+// page number. updated with atomic instructions.
+#define PA2PG(pa) (((uint64)(pa) - KERNBASE) / PGSIZE)
+int pgref[(PHYSTOP - KERNBASE) / PGSIZE];
+
+// per-CPU caches, indexed by cpuid().
+// a CPU's lock is only contended when another CPU steals from it.
+struct {
+  struct spinlock lock;
+  struct run *freelist;
+  int nfree;
+} kcpu[NCPU];
+
+// pages zeroed by idle CPUs.
 struct {
   struct spinlock lock;
   struct run *freelist;
-} kmem;
+  int nfree;
+} kzero;
 
 void
 kinit()
 {
-  initlock(&kmem.lock, "kmem");
-  freerange(end, (void*)PHYSTOP);
+  for(int i = 0; i < NCPU; i++)
+    initlock(&kcpu[i].lock, "kmem_cpu");
+  initlock(&kzero.lock, "kmem_zero");
+  buddyinit(end, (void*)PHYSTOP);
 }
 
-void
-freerange(void *pa_start, void *pa_end)
+// Move up to KBATCH pages from the buddy allocator to CPU id's cache.
+// Caller must hold kcpu[id].lock.
+static void
+refill(int id)
+{
+  void *pa[KBATCH];
+  struct run *r;
+  int i, n;
+
+  n = buddy_alloc_batch(pa, KBATCH);
+  for(i = 0; i < n; i++){
+    r = (struct run*)pa[i];
+    r->next = kcpu[id].freelist;
+    kcpu[id].freelist = r;
+  }
+  kcpu[id].nfree += n;
+}
+
+// Move KBATCH pages from CPU id's cache back to the buddy allocator.
+// Caller must hold kcpu[id].lock.
+static void
+spill(int id)
+{
+  void *pa[KBATCH];
+  struct run *r;
+  int n;
+
+  for(n = 0; n < KBATCH && (r = kcpu[id].freelist) != 0; n++){
+    kcpu[id].freelist = r->next;
+    pa[n] = r;
+  }
+  kcpu[id].nfree -= n;
+  buddy_free_batch(pa, n);
+}
+
+// Take half of some other CPU's cache, keep one page for
+// the caller and give the rest to CPU id's cache.
+// Returns 0 if every cache is empty.
+// Caller must not hold any kmem_cpu lock.
+static struct run *
+steal(int id)
+{
+  struct run *r, *head, *tail;
+  int i, n, want;
+
+  for(i = 1; i < NCPU; i++){
+    int victim = (id + i) % NCPU;
+    if(kcpu[victim].nfree == 0)  // racy peek; the lock decides.
+      continue;
+    acquire(&kcpu[victim].lock);
+    head = kcpu[victim].freelist;
+    if(head == 0){
+      release(&kcpu[victim].lock);
+      continue;
+    }
+    want = (kcpu[victim].nfree + 1) / 2;
+    tail = head;
+    for(n = 1; n < want && tail->next; n++)
+      tail = tail->next;
+    kcpu[victim].freelist = tail->next;
+    kcpu[victim].nfree -= n;
+    release(&kcpu[victim].lock);
+
+    r = head;
+    if(n > 1){
+      acquire(&kcpu[id].lock);
+      tail->next = kcpu[id].freelist;
+      kcpu[id].freelist = r->next;
+      kcpu[id].nfree += n - 1;
+      release(&kcpu[id].lock);
+    }
+    r->next = 0;
+    return r;
+  }
+  return 0;
+}
+
+// Take a page from the pre-zeroed pool, or return 0 if it is empty.
+// The page's link field is cleared, so the whole page is zero.
+static struct run *
+takezeroed(void)
 {
-  char *p;
-  p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    kfree(p);
+  struct run *r;
+
+  if(kzero.nfree == 0)  // racy peek; the lock decides.
+    return 0;
+  acquire(&kzero.lock);
+  r = kzero.freelist;
+  if(r){
+    kzero.freelist = r->next;
+    kzero.nfree--;
+  }
+  release(&kzero.lock);
+  if(r)
+    r->next = 0;
+  return r;
 }
 
-// Free the page of physical memory pointed at by pa,
-// which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+// Drop a reference to the page of physical memory pointed
+// at by pa, which should have been returned by a call to
+// kalloc(), and free it if that was the last reference.
 void
 kfree(void *pa)
 {
   struct run *r;
+  int id, n;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  if((n = __sync_sub_and_fetch(&pgref[PA2PG(pa)], 1)) > 0)
+    return;
+  if(n < 0)
+    panic("kfree: ref");
+
   // Fill with junk to catch dangling refs.
-  memset(pa, 1, PGSIZE);
+  junk(pa, 1, PGSIZE);
 
   r = (struct run*)pa;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  push_off();
+  id = cpuid();
+  acquire(&kcpu[id].lock);
+  r->next = kcpu[id].freelist;
+  kcpu[id].freelist = r;
+  kcpu[id].nfree++;
+  if(kcpu[id].nfree > KHIGH)
+    spill(id);
+  release(&kcpu[id].lock);
+  pop_off();
+}
+
+// Take a page from this CPU's cache, refilling it from the
+// buddy allocator or another CPU's cache if necessary.
+// Does not touch the pre-zeroed pool.
+static struct run *
+allocpage(void)
+{
+  struct run *r;
+  int id;
+
+  push_off();
+  id = cpuid();
+  acquire(&kcpu[id].lock);
+  if(kcpu[id].freelist == 0)
+    refill(id);
+  r = kcpu[id].freelist;
+  if(r){
+    kcpu[id].freelist = r->next;
+    kcpu[id].nfree--;
+  }
+  release(&kcpu[id].lock);
+  if(r == 0)
+    r = steal(id);
+  pop_off();
+  return r;
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -70,13 +239,113 @@ kalloc(void)
 {
   struct run *r;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  release(&kmem.lock);
+  if((r = allocpage()) == 0)
+    r = takezeroed();  // memory is short; use the zeroed pool too.
+  if(r == 0 && pagecache_reclaim() > 0)
+    r = allocpage();
 
-  if(r)
-    memset((char*)r, 5, PGSIZE); // fill with junk
+  if(r){
+    pgref[PA2PG(r)] = 1;
+    junk((char*)r, 5, PGSIZE); // fill with junk
+  }
   return (void*)r;
 }
+
+// Allocate one zero-filled page of physical memory,
+// from the pre-zeroed pool if it has one.
+// Returns 0 if the memory cannot be allocated.
+void *
+kalloc_zeroed(void)
+{
+  void *pa;
+
+  if((pa = takezeroed()) != 0){
+    pgref[PA2PG(pa)] = 1;
+    return pa;
+  }
+  if((pa = kalloc()) != 0)
+    memset(pa, 0, PGSIZE);
+  return pa;
+}
+
+// Add a reference to a page returned by kalloc(),
+// for a second mapping of it.
+void
+krefinc(void *pa)
+{
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("krefinc");
+  __sync_fetch_and_add(&pgref[PA2PG(pa)], 1);
+}
+
+// Return the number of references to a page returned by kalloc().
+int
+krefcnt(void *pa)
+{
+  return __atomic_load_n(&pgref[PA2PG(pa)], __ATOMIC_SEQ_CST);
+}
+
+// Called by an idle CPU's scheduler loop: zero one free page
+// and add it to the pre-zeroed pool, unless the pool is full.
+// Returns 1 if a page was zeroed, 0 if there was nothing to do.
+int
+kzeroidle(void)
+{
+  struct run *r;
+
+  if(kzero.nfree >= KZMAX)  // racy peek; an overshoot is harmless.
+    return 0;
+  if((r = allocpage()) == 0)
+    return 0;
+  memset(r, 0, PGSIZE);
+
+  acquire(&kzero.lock);
+  r->next = kzero.freelist;
+  kzero.freelist = r;
+  kzero.nfree++;
+  release(&kzero.lock);
+  return 1;
+}
+
+// Allocate 2^order physically contiguous pages, aligned to their
+// size, for callers that need more than one page (DMA buffers,
+// megapage mappings). Bypasses the per-CPU caches.
+// Each page gets its own reference count, so the run may
+// also be freed one page at a time with kfree().
+// Returns 0 if no such run is free.
+void *
+kalloc_pages(int order)
+{
+  void *pa;
+
+  if(order == 0)
+    return kalloc();
+  if((pa = buddy_alloc(order)) != 0){
+    junk(pa, 5, PGSIZE << order); // fill with junk
+    for(int i = 0; i < (1 << order); i++)
+      pgref[PA2PG(pa) + i] = 1;
+  }
+  return pa;
+}
+
+// Free a run of pages obtained from kalloc_pages(order).
+void
+kfree_pages(void *pa, int order)
+{
+  if(order == 0){
+    kfree(pa);
+    return;
+  }
+  if(((uint64)pa % (PGSIZE << order)) != 0 || (char*)pa < end ||
+     (uint64)pa + (PGSIZE << order) > PHYSTOP)
+    panic("kfree_pages");
+  for(int i = 0; i < (1 << order); i++){
+    if(pgref[PA2PG(pa) + i] != 1)
+      panic("kfree_pages: ref");
+    pgref[PA2PG(pa) + i] = 0;
+  }
+
+  // Fill with junk to catch dangling refs.
+  junk(pa, 1, PGSIZE << order);
+  buddy_free(pa, order);
+}
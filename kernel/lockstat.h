@@ -0,0 +1,9 @@
+// Spinlock statistics, one record per lock name,
+// as read from the lockstat device.
+struct lockstat {
+  char name[16];
+  uint64 acquire;   // acquisitions
+  uint64 contend;   // acquisitions that had to spin
+  uint64 spin;      // times round the spin loop
+  uint64 maxhold;   // longest held, in time-CSR cycles
+};
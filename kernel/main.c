@@ -6,6 +6,8 @@
 
 volatile static int started = 0;
 
+extern uint64 fdtaddr;  // start.c
+
 // start() jumps here in supervisor mode on all CPUs.
 void
 main()
@@ -16,17 +18,25 @@ main()
     printf("\n");
     printf("xv6 kernel is booting\n");
     printf("\n");
+    fdtinit(fdtaddr); // boot arguments, before kinit() frees the device tree
     kinit();         // physical page allocator
+    slabinit();      // kernel object caches
     kvminit();       // create kernel page table
     kvminithart();   // turn on paging
     procinit();      // process table
     trapinit();      // trap vectors
+    timerwheelinit(); // pause() and usleep() deadlines
+    futexinit();     // futex_wait() and futex_wake()
     trapinithart();  // install kernel trap vector
     plicinit();      // set up interrupt controller
     plicinithart();  // ask PLIC for device interrupts
     binit();         // buffer cache
     iinit();         // inode table
+    pagecacheinit(); // shared program pages
     fileinit();      // file table
+    lockstatinit();  // lock statistics device
+    pipeinit();      // pipe cache
+    shminit();       // shared memory segments
     virtio_disk_init(); // emulated hard disk
     userinit();      // first user process
     __sync_synchronize();
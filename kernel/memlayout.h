@@ -25,6 +25,11 @@
 #define VIRTIO0 0x10001000
 #define VIRTIO0_IRQ 1
 
+// core local interruptor (CLINT): writing 1 to a hart's
+// msip register sends it a machine software interrupt.
+#define CLINT 0x2000000L
+#define CLINT_MSIP(hartid) (CLINT + 4*(hartid))
+
 // qemu puts platform-level interrupt controller (PLIC) here.
 #define PLIC 0x0c000000L
 #define PLIC_PRIORITY (PLIC + 0x0)
@@ -54,6 +59,28 @@
 //   fixed-size stack
 //   expandable heap
 //   ...
-//   TRAPFRAME (p->trapframe, used by the trampoline)
+//   mmap regions, allocated downward from MMAPTOP
+//   ...
+//   THREADFRAME(i) (trapframe of the thread in proc[i])
+//   ...
+//   USYSCALL (p->usyscall, read-only to the process)
+//   TRAPFRAME (p->trapframe of the process's first thread)
 //   TRAMPOLINE (the same page as in the kernel)
 #define TRAPFRAME (TRAMPOLINE - PGSIZE)
+#define USYSCALL (TRAPFRAME - PGSIZE)
+#define THREADFRAME(i) (USYSCALL - ((i)+1)*PGSIZE)
+
+// top of the mmap area; the pages between it and USYSCALL
+// are left for threads' trapframes and other per-process
+// kernel-provided pages.
+#define MMAPTOP (USYSCALL - (NPROC+16)*PGSIZE)
+
+#ifndef __ASSEMBLER__
+// the USYSCALL page: what getpid() and uptime() in ulib.c
+// read without a system call.
+struct usyscall {
+  int pid;          // process ID
+  uint ticks;       // clock ticks since boot; may lag by a tick
+  uint64 timebase;  // time-CSR cycles per tick, for finer timing
+};
+#endif
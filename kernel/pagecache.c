@@ -0,0 +1,185 @@
+// Page cache for read-only file pages.
+//
+// vmfault() maps pages of read-only file-backed regions (program
+// text and rodata, read-only mmap()s) from this cache rather than reading a private
+// copy, so every process running the same binary shares one copy
+// of each page, and an exec of a recently run binary does not
+// read its text from disk again.
+//
+// An entry is keyed by the file (dev, inum) and the offset and
+// length of the file data in the page. The cache holds one
+// reference to each page (see kalloc.c), and each mapping holds
+// another. A page whose only reference is the cache's is idle;
+// idle pages are reused when the cache is full and freed by
+// pagecache_reclaim() when kalloc() runs out of memory.
+//
+// writei() and itrunc() call pagecache_inval() so a modified
+// file's stale pages are not mapped again; processes already
+// mapping them keep the old contents.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+
+#define NPAGECACHE 1024  // cached pages
+#define NPCHASH    61    // hash buckets, on inum
+
+struct pcent {
+  uint dev;
+  uint inum;
+  uint off;              // file offset of the page's data
+  uint n;                // bytes of file data; the rest is zero
+  uint64 pa;             // 0 if the entry is free
+  struct pcent *next;    // hash chain, or free list
+};
+
+struct {
+  struct spinlock lock;
+  struct pcent ent[NPAGECACHE];
+  struct pcent *hash[NPCHASH];
+  struct pcent *free;
+} pagecache;
+
+void
+pagecacheinit(void)
+{
+  initlock(&pagecache.lock, "pagecache");
+  for(int i = 0; i < NPAGECACHE; i++){
+    pagecache.ent[i].next = pagecache.free;
+    pagecache.free = &pagecache.ent[i];
+  }
+}
+
+// Unlink e from its hash chain, drop the cache's reference
+// to its page, and put it on the free list.
+// Caller must hold pagecache.lock.
+static void
+evict(struct pcent *e)
+{
+  struct pcent **pp;
+
+  for(pp = &pagecache.hash[e->inum % NPCHASH]; *pp != e; pp = &(*pp)->next)
+    ;
+  *pp = e->next;
+  kfree((void*)e->pa);
+  e->pa = 0;
+  e->next = pagecache.free;
+  pagecache.free = e;
+}
+
+// Find a free entry, evicting an idle page if there is none.
+// Returns 0 if every cached page is mapped somewhere.
+// Caller must hold pagecache.lock.
+static struct pcent*
+allocent(void)
+{
+  struct pcent *e;
+
+  if(pagecache.free == 0){
+    for(e = pagecache.ent; e < &pagecache.ent[NPAGECACHE]; e++){
+      if(krefcnt((void*)e->pa) == 1){
+        evict(e);
+        break;
+      }
+    }
+  }
+  if((e = pagecache.free) != 0)
+    pagecache.free = e->next;
+  return e;
+}
+
+// Return a page holding the n bytes of ip's data at offset off
+// (fewer if the file ends first), followed by zeros, with a
+// reference added for the caller.
+// The page is shared, so it must only be mapped read-only.
+// Caller must hold ip->lock.
+// Returns 0 if out of memory or the file can't be read.
+uint64
+pagecache_get(struct inode *ip, uint off, uint n)
+{
+  struct pcent *e;
+  char *mem;
+  int r;
+
+  acquire(&pagecache.lock);
+  for(e = pagecache.hash[ip->inum % NPCHASH]; e; e = e->next){
+    if(e->dev == ip->dev && e->inum == ip->inum && e->off == off && e->n == n){
+      krefinc((void*)e->pa);
+      release(&pagecache.lock);
+      return e->pa;
+    }
+  }
+  release(&pagecache.lock);
+
+  // not cached. holding ip->lock keeps anyone else from
+  // adding the same page while the lock is released.
+  if((mem = kalloc()) == 0)
+    return 0;
+  if((r = readi(ip, 0, (uint64)mem, off, n)) < 0){
+    kfree(mem);
+    return 0;
+  }
+  memset(mem + r, 0, PGSIZE - r);
+
+  acquire(&pagecache.lock);
+  if((e = allocent()) != 0){
+    e->dev = ip->dev;
+    e->inum = ip->inum;
+    e->off = off;
+    e->n = n;
+    e->pa = (uint64)mem;
+    e->next = pagecache.hash[ip->inum % NPCHASH];
+    pagecache.hash[ip->inum % NPCHASH] = e;
+    krefinc(mem);
+  }
+  release(&pagecache.lock);
+  return (uint64)mem;
+}
+
+// Forget the cached pages of file (dev, inum), which is
+// about to change.
+void
+pagecache_inval(uint dev, uint inum)
+{
+  struct pcent *e, *next;
+
+  if(pagecache.hash[inum % NPCHASH] == 0)  // racy peek; see below.
+    return;
+
+  // callers hold the inode's lock, which pagecache_get() also
+  // needs to add pages of this file, so no page of it can be
+  // added concurrently and the peek above can't miss one.
+  acquire(&pagecache.lock);
+  for(e = pagecache.hash[inum % NPCHASH]; e; e = next){
+    next = e->next;
+    if(e->dev == dev && e->inum == inum)
+      evict(e);
+  }
+  release(&pagecache.lock);
+}
+
+// Free every cached page that no process has mapped.
+// Called by kalloc() when it is out of memory.
+// Returns the number of pages freed.
+int
+pagecache_reclaim(void)
+{
+  struct pcent *e;
+  int n = 0;
+
+  acquire(&pagecache.lock);
+  for(e = pagecache.ent; e < &pagecache.ent[NPAGECACHE]; e++){
+    if(e->pa && krefcnt((void*)e->pa) == 1){
+      evict(e);
+      n++;
+    }
+  }
+  release(&pagecache.lock);
+  return n;
+}
@@ -5,14 +5,15 @@
 #endif
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NVMA         16  // mapped memory regions per process
+#define NSHM         16  // shared memory segments
+#define SHMPAGES    256  // maximum pages per shared memory segment
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
 #define LOGBLOCKS    (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
+#define NBUF         (MAXOPBLOCKS*3)  // disk block cache bufs kept when idle
 #ifdef LAB_FS
 #define FSSIZE       200000  // size of file system in blocks
 #else
@@ -23,6 +24,12 @@
 #endif
 #endif
 #define MAXPATH      128   // maximum file path name
+#define SWAPPAGES    8192  // pages of swap space, on disk after the file system
+#define TIMEBASE     10000000  // time-CSR cycles per second in qemu
+#define TICKCYCLES   (TIMEBASE/10)  // time-CSR cycles per clock tick, unless hz= says otherwise
+#define IDLECYCLES   (TIMEBASE/10)  // longest an idle CPU sleeps before looking for work
+#define NPRIO         3  // priority levels of the sched=mlfq scheduler
+#define BOOSTTICKS   50  // ticks between sched=mlfq priority boosts
 
 #ifdef LAB_UTIL
 #define USERSTACK    2     // user stack pages
@@ -17,19 +17,25 @@ struct pipe {
     uint nwrite;    // number of bytes written
     int readopen;   // read fd is still open
     int writeopen;  // write fd is still open
+    int reading;    // a reader is copying out bytes not yet consumed
 };
 
+static struct kcache *pipecache;
+
+void pipeinit(void) { pipecache = kcache_create("pipe", sizeof(struct pipe)); }
+
 int pipealloc(struct file **f0, struct file **f1) {
     struct pipe *pi;
 
     pi = 0;
     *f0 = *f1 = 0;
     if ((*f0 = filealloc()) == 0 || (*f1 = filealloc()) == 0) goto bad;
-    if ((pi = (struct pipe *)kalloc()) == 0) goto bad;
+    if ((pi = kcache_alloc(pipecache)) == 0) goto bad;
     pi->readopen = 1;
     pi->writeopen = 1;
     pi->nwrite = 0;
     pi->nread = 0;
+    pi->reading = 0;
     initlock(&pi->lock, "pipe");
     (*f0)->type = FD_PIPE;
     (*f0)->readable = 1;
@@ -42,7 +48,7 @@ int pipealloc(struct file **f0, struct file **f1) {
     return 0;
 
 bad:
-    if (pi) kfree((char *)pi);
+    if (pi) kcache_free(pipecache, pi);
     if (*f0) fileclose(*f0);
     if (*f1) fileclose(*f1);
     return -1;
@@ -59,56 +65,90 @@ void pipeclose(struct pipe *pi, int writable) {
     }
     if (pi->readopen == 0 && pi->writeopen == 0) {
         release(&pi->lock);
-        kfree((char *)pi);
+        kcache_free(pipecache, pi);
     } else
         release(&pi->lock);
 }
 
+// Copy between user memory and the pipe through a buffer on the
+// kernel stack, a chunk at a time, so that copyin() and copyout()
+// walk the page table once per chunk instead of once per byte, and
+// run without pi->lock held, since they may sleep faulting a page in.
 int pipewrite(struct pipe *pi, uint64 addr, int n) {
-    int i = 0;
+    int i = 0, k, m, c;
+    char buf[PIPESIZE];
     struct proc *pr = myproc();
 
-    acquire(&pi->lock);
     while (i < n) {
-        if (pi->readopen == 0 || killed(pr)) {
-            release(&pi->lock);
-            return -1;
-        }
-        if (pi->nwrite == pi->nread + PIPESIZE) {  // DOC: pipewrite-full
-            wakeup(&pi->nread);
-            sleep(&pi->nwrite, &pi->lock);
-        } else {
-            char ch;
-            if (copyin(pr->pagetable, &ch, addr + i, 1) == -1) break;
-            pi->data[pi->nwrite++ % PIPESIZE] = ch;
-            i++;
+        m = n - i < PIPESIZE ? n - i : PIPESIZE;
+        if (copyin(pr->pagetable, buf, addr + i, m) == -1) break;
+        acquire(&pi->lock);
+        for (k = 0; k < m;) {
+            if (pi->readopen == 0 || killed(pr)) {
+                release(&pi->lock);
+                return -1;
+            }
+            if (pi->nwrite == pi->nread + PIPESIZE) {  // DOC: pipewrite-full
+                wakeup(&pi->nread);
+                sleep(&pi->nwrite, &pi->lock);
+                continue;
+            }
+            // as much as fits before the pipe is full or data[] wraps.
+            c = m - k;
+            if (c > pi->nread + PIPESIZE - pi->nwrite) c = pi->nread + PIPESIZE - pi->nwrite;
+            if (c > PIPESIZE - pi->nwrite % PIPESIZE) c = PIPESIZE - pi->nwrite % PIPESIZE;
+            memmove(&pi->data[pi->nwrite % PIPESIZE], buf + k, c);
+            pi->nwrite += c;
+            k += c;
         }
+        wakeup(&pi->nread);
+        release(&pi->lock);
+        i += m;
     }
-    wakeup(&pi->nread);
-    release(&pi->lock);
 
     return i;
 }
 
+// The bytes stay in the pipe until copyout() has succeeded, so
+// a bad addr loses none of them; pi->reading keeps other readers
+// from taking the same bytes meanwhile.
 int piperead(struct pipe *pi, uint64 addr, int n) {
-    int i;
+    int i, c;
+    uint r;
+    char buf[PIPESIZE];
     struct proc *pr = myproc();
-    char ch;
 
     acquire(&pi->lock);
-    while (pi->nread == pi->nwrite && pi->writeopen) {  // DOC: pipe-empty
+    while (pi->reading || (pi->nread == pi->nwrite && pi->writeopen)) {  // DOC: pipe-empty
         if (killed(pr)) {
             release(&pi->lock);
             return -1;
         }
         sleep(&pi->nread, &pi->lock);  // DOC: piperead-sleep
     }
-    for (i = 0; i < n; i++) {  // DOC: piperead-copy
-        if (pi->nread == pi->nwrite) break;
-        ch = pi->data[pi->nread++ % PIPESIZE];
-        if (copyout(pr->pagetable, addr + i, &ch, 1) == -1) break;
+    r = pi->nread;
+    for (i = 0; i < n && r != pi->nwrite; i += c, r += c) {  // DOC: piperead-copy
+        c = n - i;
+        if (c > pi->nwrite - r) c = pi->nwrite - r;
+        if (c > PIPESIZE - r % PIPESIZE) c = PIPESIZE - r % PIPESIZE;
+        memmove(buf + i, &pi->data[r % PIPESIZE], c);
+    }
+    if (i == 0) {
+        release(&pi->lock);
+        return 0;
     }
-    wakeup(&pi->nwrite);  // DOC: piperead-wakeup
+    pi->reading = 1;
+    release(&pi->lock);
+
+    if (copyout(pr->pagetable, addr, buf, i) == -1) i = -1;
+
+    acquire(&pi->lock);
+    if (i > 0) {
+        pi->nread += i;
+        wakeup(&pi->nwrite);  // DOC: piperead-wakeup
+    }
+    pi->reading = 0;
+    wakeup(&pi->nread);
     release(&pi->lock);
     return i;
 }
@@ -3,6 +3,7 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
 #include "defs.h"
 
@@ -12,11 +13,51 @@ struct proc proc[NPROC];
 
 struct proc *initproc;
 
+enum schedpolicy schedpolicy = SCHED_RR;  // from the sched= boot argument
+
 int nextpid = 1;
 struct spinlock pid_lock;
 
+// each process's TLB entries are tagged with its own ASID, so
+// switching page tables needs no TLB flush. when the ASIDs run
+// out, a new generation starts: a process whose ASID is from an
+// old generation gets a new one the next time it runs, and each
+// CPU flushes its whole TLB before it runs anything with an ASID
+// from the new generation.
+struct {
+    struct spinlock lock;
+    uint64 gen;   // current generation, starting at 1
+    uint64 next;  // next unused ASID of this generation
+    uint64 max;   // largest ASID the hardware supports, or 0
+} asids;
+
+// sleep() puts a process on the wait queue its channel hashes
+// to, so that wakeup() looks only at processes sleeping on
+// channels that hash alike rather than at all of proc[]. A woken
+// process leaves the queue on its way out of sleep(), so a queue
+// can also hold processes that have been woken but not run yet;
+// wakeup() skips those.
+// lock order: the sleeper's condition lock, a wait queue's lock,
+// then p->lock.
+#define NWAITQ 64
+struct waitq {
+    struct spinlock lock;
+    struct proc *head;
+} waitqs[NWAITQ];
+
+// a process's threads share its page table, sz and vma[]; its
+// vmlock, vmlocks[i] for the process whose first thread is
+// proc[i], keeps them from changing these at once, and from
+// unmapping pages that a fault or a copyin() in another thread
+// is using. held across disk reads, so it is a sleep-lock, and
+// never held where p->swapok is set.
+// lock order: the vmlock, then the log, inodes and bufs.
+static struct sleeplock vmlocks[NPROC];
+
 extern void forkret(void);
 static void freeproc(struct proc *p);
+static void setrunnable(struct proc *p);
+static void idle(struct cpu *c);
 
 extern char trampoline[];  // trampoline.S
 
@@ -46,9 +87,33 @@ void procinit(void) {
 
     initlock(&pid_lock, "nextpid");
     initlock(&wait_lock, "wait_lock");
+    initlock(&asids.lock, "asids");
+    for (int i = 0; i < NCPU; i++) initlock(&cpus[i].runq.lock, "runq");
+    for (int i = 0; i < NWAITQ; i++) initlock(&waitqs[i].lock, "waitq");
+
+    char arg[8];
+    if (bootarg("sched", arg, sizeof(arg)) >= 0) {
+        if (strncmp(arg, "mlfq", sizeof(arg)) == 0) schedpolicy = SCHED_MLFQ;
+        else if (strncmp(arg, "rr", sizeof(arg)) != 0)
+            printf("unknown scheduler sched=%s; using rr\n", arg);
+    }
+
+    // find how many ASID bits the hardware implements by
+    // writing ones to them and reading back what stuck.
+    uint64 satp = r_satp();
+    w_satp(satp | SATP_ASID(0xFFFF));
+    asids.max = SATP2ASID(r_satp());
+    w_satp(satp);
+    sfence_vma();
+    asids.gen = 1;
+    asids.next = 1;
+
     for (p = proc; p < &proc[NPROC]; p++) {
         initlock(&p->lock, "proc");
+        initsleeplock(&vmlocks[p - proc], "vmlock");
         p->state = UNUSED;
+        p->cpu = -1;
+        p->affinity = ~0L;
         p->kstack = KSTACK((int)(p - proc));
     }
 }
@@ -78,6 +143,136 @@ struct proc *myproc(void) {
     return p;
 }
 
+// Take the vmlock of p's process, unless the caller already
+// holds it, as a vmfault() from inside copyout() does.
+// returns 1 if it took the lock, and the caller must vmunlock().
+int vmlock(struct proc *p) {
+    struct sleeplock *lk = &vmlocks[p->group - proc];
+
+    if (holdingsleep(lk)) return 0;
+    acquiresleep(lk);
+    return 1;
+}
+
+void vmunlock(struct proc *p) {
+    releasesleep(&vmlocks[p->group - proc]);
+}
+
+// The ASID and its TLB bookkeeping belong to the process, so
+// these take any thread of it and use its first thread's fields.
+
+// Give p a fresh ASID. Caller must hold asids.lock.
+static void asidnext(struct proc *p) {
+    if (asids.next > asids.max) {
+        asids.gen++;
+        asids.next = 1;
+    }
+    p->asid = (asids.gen << 16) | asids.next++;
+    p->tlbcpus = 0;
+    p->tlbstale = 0;
+}
+
+// Give new process p a fresh ASID.
+static void asidalloc(struct proc *p) {
+    if (asids.max == 0) {
+        p->asid = 0;
+        p->tlbcpus = 0;
+        p->tlbstale = 0;
+        return;
+    }
+    acquire(&asids.lock);
+    asidnext(p);
+    release(&asids.lock);
+}
+
+// Return the satp value that runs p's user page table on this
+// CPU, first flushing whatever TLB entries this CPU may hold that
+// p could otherwise use wrongly.
+// Interrupts must be disabled.
+uint64 asidsatp(struct proc *p) {
+    struct cpu *c = mycpu();
+    uint64 me = 1L << cpuid();
+
+    // tell asidsync() that this CPU will be using p's process's
+    // TLB entries, before looking at what it must flush.
+    c->user = p->group;
+    __sync_synchronize();
+    p = p->group;
+
+    if (asids.max == 0) {
+        // no ASIDs: trampoline.S flushes the whole TLB instead.
+        return MAKE_SATP(p->pagetable);
+    }
+    if ((p->asid >> 16) != __atomic_load_n(&asids.gen, __ATOMIC_ACQUIRE)) {
+        // other threads of p's process may find its ASID old on
+        // other CPUs at the same time; only the first gives it a
+        // new one, so none runs on after another reset tlbstale.
+        acquire(&asids.lock);
+        if ((p->asid >> 16) != asids.gen) asidnext(p);
+        release(&asids.lock);
+    }
+    if (c->asidgen != (p->asid >> 16)) {
+        // this CPU may hold entries for p's ASID from when an
+        // earlier generation gave it to some other process.
+        sfence_vma();
+        c->asidgen = p->asid >> 16;
+        __sync_fetch_and_and(&p->tlbstale, ~me);
+    } else if (p->tlbstale & me) {
+        sfence_vma_asid(p->asid & 0xFFFF);
+        __sync_fetch_and_and(&p->tlbstale, ~me);
+    }
+    __sync_fetch_and_or(&p->tlbcpus, me);
+    return MAKE_SATP(p->pagetable) | SATP_ASID(p->asid);
+}
+
+// p's PTE for user address va has changed, or all of them
+// have if va is -1. Flush the stale TLB entries on this CPU,
+// and make the other CPUs that may hold some flush before they
+// next run p.
+void asidflush(struct proc *p, uint64 va) {
+    uint64 asid;
+
+    p = p->group;
+    asid = asids.max ? p->asid & 0xFFFF : 0;
+    push_off();
+    if (va == -1)
+        sfence_vma_asid(asid);
+    else
+        sfence_vma_page(va, asid);
+    __sync_fetch_and_or(&p->tlbstale, p->tlbcpus & ~(1L << cpuid()));
+    pop_off();
+}
+
+// Interrupt CPU i, through the CLINT and mswvec in kernelvec.S:
+// wake it from the wfi in idle(), or make it trap if it is
+// running user code.
+static void cpuwake(int i) {
+    __atomic_store_n((uint32 *)CLINT_MSIP(i), 1, __ATOMIC_RELEASE);
+}
+
+// Wait until no other CPU can still be using TLB entries that
+// asidflush() has marked stale for p's process, because any
+// running its threads in user mode has since trapped into the
+// kernel, and so will flush before it returns. An interrupt
+// makes each such CPU trap now rather than at its next tick;
+// this returns at once if the process has one thread. Should
+// be called holding no spinlocks.
+void asidsync(struct proc *p) {
+    struct proc *g = p->group;
+    struct cpu *c;
+    uint64 traps;
+
+    if (g->nthreads == 0) return;
+    for (c = cpus; c < &cpus[NCPU]; c++) {
+        if (__atomic_load_n(&c->user, __ATOMIC_ACQUIRE) != g) continue;
+        traps = __atomic_load_n(&c->usertraps, __ATOMIC_ACQUIRE);
+        cpuwake(c - cpus);
+        while (__atomic_load_n(&c->user, __ATOMIC_ACQUIRE) == g &&
+               __atomic_load_n(&c->usertraps, __ATOMIC_ACQUIRE) == traps)
+            ;
+    }
+}
+
 int allocpid() {
     int pid;
 
@@ -91,9 +286,11 @@ int allocpid() {
 
 // Look in the process table for an UNUSED proc.
 // If found, initialize state required to run in the kernel,
-// and return with p->lock held.
+// and return with p->lock held. With g 0 it is a new process,
+// with an empty user page table; otherwise it is a new thread
+// of g's process, and the caller must hold g's vmlock.
 // If there are no free procs, or a memory allocation fails, return 0.
-static struct proc *allocproc(void) {
+static struct proc *allocproc(struct proc *g) {
     struct proc *p;
 
     for (p = proc; p < &proc[NPROC]; p++) {
@@ -109,6 +306,7 @@ static struct proc *allocproc(void) {
 found:
     p->pid = allocpid();
     p->state = USED;
+    p->group = g ? g : p;
 
     // Allocate a trapframe page.
     if ((p->trapframe = (struct trapframe *)kalloc()) == 0) {
@@ -117,6 +315,30 @@ found:
         return 0;
     }
 
+    if (g) {
+        // map the trapframe in the shared page table, at an
+        // address of its own, for trampoline.S.
+        p->trapframeva = THREADFRAME(p - proc);
+        if (mappages(g->pagetable, p->trapframeva, PGSIZE, (uint64)p->trapframe, PTE_R | PTE_W) < 0) {
+            freeproc(p);
+            release(&p->lock);
+            return 0;
+        }
+        p->pagetable = g->pagetable;
+        goto context;
+    }
+    asidalloc(p);
+    p->trapframeva = TRAPFRAME;
+
+    // Allocate the usyscall page.
+    if ((p->usyscall = (struct usyscall *)kalloc_zeroed()) == 0) {
+        freeproc(p);
+        release(&p->lock);
+        return 0;
+    }
+    p->usyscall->pid = p->pid;
+    p->usyscall->timebase = tickcycles;
+
     // An empty user page table.
     p->pagetable = proc_pagetable(p);
     if (p->pagetable == 0) {
@@ -125,6 +347,7 @@ found:
         return 0;
     }
 
+context:
     // Set up new context to start executing at forkret,
     // which returns to user space.
     memset(&p->context, 0, sizeof(p->context));
@@ -135,13 +358,26 @@ found:
 }
 
 // free a proc structure and the data hanging from it,
-// including user pages.
+// including user pages, unless it is a thread other than the
+// process's first, which leaves the process's memory alone.
 // p->lock must be held.
 static void freeproc(struct proc *p) {
+    if (p->group != p && p->pagetable) {
+        // the page table stays in use by the other threads, whose
+        // own trapframe mappings are elsewhere in it, so this
+        // needs no vmlock.
+        uvmunmap(p->pagetable, p->trapframeva, 1, 0);
+    } else if (p->pagetable) {
+        proc_freepagetable(p->pagetable, p->sz);
+    }
+    p->pagetable = 0;
     if (p->trapframe) kfree((void *)p->trapframe);
     p->trapframe = 0;
-    if (p->pagetable) proc_freepagetable(p->pagetable, p->sz);
-    p->pagetable = 0;
+    if (p->usyscall) kfree((void *)p->usyscall);
+    p->usyscall = 0;
+    p->group = 0;
+    p->trapframeva = 0;
+    p->nthreads = 0;
     p->sz = 0;
     p->pid = 0;
     p->parent = 0;
@@ -149,6 +385,12 @@ static void freeproc(struct proc *p) {
     p->waitChannel = 0;
     p->killed = 0;
     p->xstate = 0;
+    p->cpu = -1;
+    p->affinity = ~0L;
+    p->nice = 0;
+    p->prio = 0;
+    p->used = 0;
+    p->boost = 0;
     p->state = UNUSED;
 }
 
@@ -178,6 +420,15 @@ pagetable_t proc_pagetable(struct proc *p) {
         return 0;
     }
 
+    // map the usyscall page below the trapframe, read-only,
+    // so user code can read it without a system call.
+    if (mappages(pagetable, USYSCALL, PGSIZE, (uint64)(p->usyscall), PTE_R | PTE_U) < 0) {
+        uvmunmap(pagetable, TRAPFRAME, 1, 0);
+        uvmunmap(pagetable, TRAMPOLINE, 1, 0);
+        uvmfree(pagetable, 0);
+        return 0;
+    }
+
     return pagetable;
 }
 
@@ -186,6 +437,7 @@ pagetable_t proc_pagetable(struct proc *p) {
 void proc_freepagetable(pagetable_t pagetable, uint64 sz) {
     uvmunmap(pagetable, TRAMPOLINE, 1, 0);
     uvmunmap(pagetable, TRAPFRAME, 1, 0);
+    uvmunmap(pagetable, USYSCALL, 1, 0);
     uvmfree(pagetable, sz);
 }
 
@@ -193,12 +445,12 @@ void proc_freepagetable(pagetable_t pagetable, uint64 sz) {
 void userinit(void) {
     struct proc *p;
 
-    p = allocproc();
+    p = allocproc(0);
     initproc = p;
 
     p->cwd = namei("/");
 
-    p->state = RUNNABLE;
+    setrunnable(p);
 
     release(&p->lock);
 }
@@ -207,39 +459,64 @@ void userinit(void) {
 // Return 0 on success, -1 on failure.
 int growproc(int n) {
     uint64 sz;
-    struct proc *p = myproc();
+    struct proc *p = myproc()->group;
+    int locked = vmlock(p), r = 0;
 
     sz = p->sz;
     if (n > 0) {
-        if ((sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0) {
-            return -1;
+        if (sz + n > mmapbase(p) || (sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0) {
+            r = -1;
+            goto out;
         }
     } else if (n < 0) {
         sz = uvmdealloc(p->pagetable, sz, sz + n);
+        // heap memory above sz no longer comes from a program segment.
+        for (struct vma *v = p->vma; v < &p->vma[NVMA]; v++)
+            if (v->flags && v->start < p->sz && v->end > sz) v->end = v->start < sz ? sz : v->start;
     }
     p->sz = sz;
-    return 0;
+out:
+    if (locked) vmunlock(p);
+    return r;
 }
 
 // Create a new process, copying the parent.
 // Sets up child kernel stack to return as if from fork() system call.
+// A thread forks its whole process, but only itself runs in
+// the child.
 int kfork(void) {
     int i, pid;
     struct proc *np;
-    struct proc *p = myproc();
+    struct proc *p = myproc(), *g = p->group;
+
+    // hold the other threads off the parent's memory while its
+    // PTEs are made copy-on-write.
+    vmlock(p);
 
     // Allocate process.
-    if ((np = allocproc()) == 0) {
+    if ((np = allocproc(0)) == 0) {
+        vmunlock(p);
         return -1;
     }
 
     // Copy user memory from parent to child.
-    if (uvmcopy(p->pagetable, np->pagetable, p->sz) < 0) {
+    if (uvmcopy(g->pagetable, np->pagetable, g->sz) < 0) {
+        freeproc(np);
+        release(&np->lock);
+        vmunlock(p);
+        return -1;
+    }
+    np->sz = g->sz;
+    np->heapadvice = g->heapadvice;
+    np->nice = p->nice;
+    np->affinity = p->affinity;
+    if (schedpolicy == SCHED_MLFQ) np->prio = np->nice;
+    if (vmacopy(g, np) < 0) {
         freeproc(np);
         release(&np->lock);
+        vmunlock(p);
         return -1;
     }
-    np->sz = p->sz;
 
     // copy saved user registers.
     *(np->trapframe) = *(p->trapframe);
@@ -247,28 +524,221 @@ int kfork(void) {
     // Cause fork to return 0 in the child.
     np->trapframe->a0 = 0;
 
-    // increment reference counts on open file descriptors.
-    for (i = 0; i < NOFILE; i++)
-        if (p->ofile[i]) np->ofile[i] = filedup(p->ofile[i]);
-    np->cwd = idup(p->cwd);
-
     safestrcpy(np->name, p->name, sizeof(p->name));
 
     pid = np->pid;
 
     release(&np->lock);
+    vmunlock(p);
+
+    // increment reference counts on open file descriptors,
+    // which g->lock keeps other threads from closing meanwhile.
+    // not under np->lock: groupstop() takes g->lock and then
+    // every proc's lock. nothing else looks at np until it is
+    // RUNNABLE.
+    acquire(&g->lock);
+    for (i = 0; i < NOFILE; i++)
+        if (g->ofile[i]) np->ofile[i] = filedup(g->ofile[i]);
+    np->cwd = idup(g->cwd);
+    release(&g->lock);
+
+    // the other threads must stop writing through TLB entries
+    // from before the pages went copy-on-write before the child
+    // can see the pages.
+    asidsync(p);
 
     acquire(&wait_lock);
-    np->parent = p;
+    np->parent = g;
     release(&wait_lock);
 
     acquire(&np->lock);
-    np->state = RUNNABLE;
+    setrunnable(np);
     release(&np->lock);
 
     return pid;
 }
 
+// Create a new thread in the current process, sharing its
+// memory and open files, that starts in user space at fn with
+// arg in a0 and sp as its stack pointer.
+// Returns the new thread's id (its pid), or -1.
+int kclone(uint64 fn, uint64 arg, uint64 sp) {
+    struct proc *np;
+    struct proc *p = myproc(), *g = p->group;
+    int tid;
+
+    // count it before it exists, for groupstop().
+    acquire(&g->lock);
+    g->nthreads++;
+    release(&g->lock);
+
+    vmlock(p);
+    if ((np = allocproc(g)) == 0) {
+        vmunlock(p);
+        acquire(&g->lock);
+        g->nthreads--;
+        release(&g->lock);
+        return -1;
+    }
+
+    *(np->trapframe) = *(p->trapframe);
+    np->trapframe->epc = fn;
+    np->trapframe->a0 = arg;
+    np->trapframe->sp = sp;
+    np->nice = p->nice;
+    np->affinity = p->affinity;
+    if (schedpolicy == SCHED_MLFQ) np->prio = np->nice;
+    safestrcpy(np->name, p->name, sizeof(p->name));
+    tid = np->pid;
+
+    release(&np->lock);
+    vmunlock(p);
+
+    acquire(&np->lock);
+    setrunnable(np);
+    release(&np->lock);
+
+    return tid;
+}
+
+// Free thread t, a ZOMBIE, of g's process.
+// Caller must hold wait_lock and t->lock; releases t->lock.
+static void freethread(struct proc *g, struct proc *t) {
+    freeproc(t);
+    release(&t->lock);
+    acquire(&g->lock);
+    g->nthreads--;
+    release(&g->lock);
+}
+
+// Wait for thread tid of the current process to exit, copy its
+// exit status to addr if it is not 0, and free it.
+// Returns 0, or -1 if there is no such thread other than the
+// process's first and the caller, or if killed.
+int kjoin(int tid, uint64 addr) {
+    struct proc *t;
+    struct proc *p = myproc(), *g = p->group;
+    int found, xstate;
+
+    acquire(&wait_lock);
+    for (;;) {
+    again:
+        found = 0;
+        for (t = proc; t < &proc[NPROC]; t++) {
+            if (t->group != g || t == g || t == p || t->pid != tid) continue;
+            acquire(&t->lock);
+            if (t->group == g && t->pid == tid) {
+                found = 1;
+                if (t->state == ZOMBIE) {
+                    // copy out as kwait() does: with no spinlocks
+                    // held, before freeing t, so that a bad addr
+                    // leaves it for a retry.
+                    xstate = t->xstate;
+                    if (addr != 0) {
+                        release(&t->lock);
+                        release(&wait_lock);
+                        if (copyout(p->pagetable, addr, (char *)&xstate, sizeof(xstate)) < 0) return -1;
+                        acquire(&wait_lock);
+                        acquire(&t->lock);
+                        if (t->group != g || t->pid != tid || t->state != ZOMBIE) {
+                            // another thread joined it meanwhile.
+                            release(&t->lock);
+                            goto again;
+                        }
+                    }
+                    freethread(g, t);
+                    release(&wait_lock);
+                    return 0;
+                }
+            }
+            release(&t->lock);
+        }
+        if (!found || killed(p)) {
+            release(&wait_lock);
+            return -1;
+        }
+        // a thread that exits wakes its process's first thread.
+        p->swapok = 1;  // nothing here uses the process's pages
+        sleep(g, &wait_lock);
+        p->swapok = 0;
+    }
+}
+
+// Kill the other threads of p's process, whose first thread p
+// must be, and wait for them to exit and free them.
+void killthreads(struct proc *p) {
+    struct proc *t;
+    int n;
+
+    acquire(&wait_lock);
+    for (;;) {
+        n = 0;
+        for (t = proc; t < &proc[NPROC]; t++) {
+            if (t->group != p || t == p) continue;
+            acquire(&t->lock);
+            if (t->group == p && t->state == ZOMBIE) {
+                freethread(p, t);
+                continue;
+            }
+            if (t->group == p) {
+                n++;
+                t->killed = 1;
+                if (t->state == SLEEPING) setrunnable(t);
+            }
+            release(&t->lock);
+        }
+        if (n == 0) break;
+        // a thread cloned since this pass will be killed on the next.
+        sleep(p, &wait_lock);
+    }
+    release(&wait_lock);
+}
+
+// Lock every thread of g's process if none of them can be using
+// its user pages: each is the caller, or not running and stopped
+// where p->swapok says it holds no pointers into them, or not
+// started or already exited. Caller must hold g->lock.
+// returns 1 with the other threads' locks held, for
+// groupresume(), or 0 with none.
+int groupstop(struct proc *g) {
+    struct proc *p = myproc(), *t;
+    int n = 0;
+
+    if (g != p && !(g->swapok && (g->state == RUNNABLE || g->state == SLEEPING))) return 0;
+    if (g->nthreads == 0) return 1;
+    // g->lock keeps kclone() from counting another thread, and
+    // a thread's lock keeps it from running or being freed.
+    for (t = proc; t < &proc[NPROC]; t++) {
+        // only g's threads, as a hint first: another process's
+        // lock may be held by a CPU waiting for g->lock.
+        if (t == g || t->group != g) continue;
+        acquire(&t->lock);
+        if (t->group != g) {
+            release(&t->lock);
+            continue;
+        }
+        n++;
+        if (t != p && t->state != USED && t->state != ZOMBIE &&
+            !(t->swapok && (t->state == RUNNABLE || t->state == SLEEPING))) {
+            release(&t->lock);
+            groupresume(g);
+            return 0;
+        }
+    }
+    if (n != g->nthreads) {
+        // one is still on its way into proc[].
+        groupresume(g);
+        return 0;
+    }
+    return 1;
+}
+
+// Release the locks groupstop() took.
+void groupresume(struct proc *g) {
+    for (struct proc *t = proc; t < &proc[NPROC]; t++)
+        if (t != g && t->group == g && holding(&t->lock)) release(&t->lock);
+}
+
 // Pass p's abandoned children to init.
 // Caller must hold wait_lock.
 void reparent(struct proc *p) {
@@ -284,33 +754,50 @@ void reparent(struct proc *p) {
 
 // Exit the current process.  Does not return.
 // An exited process remains in the zombie state
-// until its parent calls wait().
+// until its parent calls wait(). A thread other than the
+// process's first exits by itself, and remains a zombie until
+// another thread calls join(); the first thread takes the others
+// with it.
 void kexit(int status) {
     struct proc *p = myproc();
 
     if (p == initproc) panic("init exiting");
 
-    // Close all open files.
-    for (int fd = 0; fd < NOFILE; fd++) {
-        if (p->ofile[fd]) {
-            struct file *f = p->ofile[fd];
-            fileclose(f);
-            p->ofile[fd] = 0;
+    if (p == p->group) {
+        killthreads(p);
+
+        // Close all open files.
+        for (int fd = 0; fd < NOFILE; fd++) {
+            if (p->ofile[fd]) {
+                struct file *f = p->ofile[fd];
+                fileclose(f);
+                p->ofile[fd] = 0;
+            }
         }
-    }
 
-    begin_op();
-    iput(p->cwd);
-    end_op();
-    p->cwd = 0;
+        // Unmap memory regions, writing back shared file mappings.
+        for (int i = 0; i < NVMA; i++)
+            if (p->vma[i].flags) vmaunmap(p->pagetable, &p->vma[i], p->vma[i].start, p->vma[i].end);
+
+        begin_op();
+        iput(p->cwd);
+        end_op();
+        p->cwd = 0;
+    }
 
     acquire(&wait_lock);
 
-    // Give any children to init.
-    reparent(p);
+    if (p == p->group) {
+        // Give any children to init.
+        reparent(p);
 
-    // Parent might be sleeping in wait().
-    wakeup(p->parent);
+        // Parent might be sleeping in wait().
+        wakeup(p->parent);
+    } else {
+        // another thread might be sleeping in join(), or
+        // the first thread in exit().
+        wakeup(p->group);
+    }
 
     acquire(&p->lock);
 
@@ -326,30 +813,42 @@ void kexit(int status) {
 
 // Wait for a child process to exit and return its pid.
 // Return -1 if this process has no children.
+// Any thread may wait for any of the process's children.
 int kwait(uint64 addr) {
     struct proc *pp;
-    int havekids, pid;
-    struct proc *p = myproc();
+    int havekids, pid, xstate;
+    struct proc *p = myproc(), *g = p->group;
 
     acquire(&wait_lock);
 
     for (;;) {
+    again:
         // Scan through table looking for exited children.
         havekids = 0;
         for (pp = proc; pp < &proc[NPROC]; pp++) {
-            if (pp->parent == p) {
+            if (pp->parent == g) {
                 // make sure the child isn't still in exit() or swtch().
                 acquire(&pp->lock);
 
                 havekids = 1;
                 if (pp->state == ZOMBIE) {
-                    // Found one.
+                    // Found one. copy out its status with no spinlocks
+                    // held, since copyout() may have to wait for the
+                    // vmlock or fault the page in, but before freeing
+                    // it, so that a bad addr leaves it for a retry.
                     pid = pp->pid;
-                    if (addr != 0 &&
-                        copyout(p->pagetable, addr, (char *)&pp->xstate, sizeof(pp->xstate)) < 0) {
+                    xstate = pp->xstate;
+                    if (addr != 0) {
                         release(&pp->lock);
                         release(&wait_lock);
-                        return -1;
+                        if (copyout(p->pagetable, addr, (char *)&xstate, sizeof(xstate)) < 0) return -1;
+                        acquire(&wait_lock);
+                        acquire(&pp->lock);
+                        if (pp->parent != g || pp->pid != pid || pp->state != ZOMBIE) {
+                            // another thread reaped it meanwhile.
+                            release(&pp->lock);
+                            goto again;
+                        }
                     }
                     freeproc(pp);
                     release(&pp->lock);
@@ -367,10 +866,318 @@ int kwait(uint64 addr) {
         }
 
         // Wait for a child to exit.
-        sleep(p, &wait_lock);  // DOC: wait-sleep
+        p->swapok = 1;  // nothing here uses p's pages
+        sleep(g, &wait_lock);  // DOC: wait-sleep
+        p->swapok = 0;
+    }
+}
+
+// Each CPU has its own queue of RUNNABLE processes, so picking
+// the next process to run takes one lock rather than a scan of
+// proc[]. A process goes back on the queue of the CPU it last
+// ran on, whose caches may still hold its data; a new one goes
+// on the shortest queue. A CPU with nothing of its own to run
+// takes a process from the longest queue.
+//
+// A process runs only on the CPUs in its affinity mask, set by
+// sched_setaffinity(): it goes on the queue of one of them, and
+// no other CPU takes it from there.
+//
+// A RUNNABLE process is on exactly one queue, or has just been
+// taken off one by the one scheduler() that is about to run it.
+//
+// With the sched=mlfq boot argument, a queue has a list for
+// each priority level, and the highest-priority process runs
+// first. A process that uses up its quantum of 1 << level ticks
+// drops a level; one that sleeps first keeps its level. Every
+// BOOSTTICKS ticks, every process goes back up to its nice()
+// level, so that none starves. With the default sched=rr,
+// every process stays at level 0, in plain round robin.
+
+// Move p back up to its nice() level if there has been a
+// priority boost since it was last moved. Caller must hold
+// p->lock, or the lock of the run queue p is on.
+static void boost(struct proc *p) {
+    uint b = ticks / BOOSTTICKS;
+
+    if (p->boost != b) {
+        p->boost = b;
+        p->prio = p->nice;
+        p->used = 0;
+    }
+}
+
+// Add p to the tail of its priority level's list.
+// Caller must hold rq->lock.
+static void runqappend(struct runq *rq, struct proc *p) {
+    p->rqnext = 0;
+    if (rq->tail[p->prio]) rq->tail[p->prio]->rqnext = p;
+    else
+        rq->head[p->prio] = p;
+    rq->tail[p->prio] = p;
+}
+
+// The CPU p may run on with the shortest queue, or this one
+// if it is as short, among those serving their queues, and
+// awake if awake is set; or -1 if there is none. Lengths and
+// states are read without locks, as hints.
+static int pickcpu(struct proc *p, int awake) {
+    int i, best = -1;
+
+    for (i = 0; i < NCPU; i++) {
+        if (!cpus[i].live || !(p->affinity & (1L << i)) || (awake && cpus[i].idle)) continue;
+        if (best < 0 || cpus[i].runq.n < cpus[best].runq.n || (i == cpuid() && cpus[i].runq.n == cpus[best].runq.n))
+            best = i;
+    }
+    return best;
+}
+
+// Mark p RUNNABLE and put it on a run queue.
+// Caller must hold p->lock.
+static void setrunnable(struct proc *p) {
+    struct runq *rq;
+    int i;
+
+    if (!holding(&p->lock)) panic("setrunnable");
+    if (p->cpu < 0 || !(p->affinity & (1L << p->cpu))) {
+        // a new process, or one that may no longer run where
+        // it last did; or this CPU while the others are booting.
+        if ((p->cpu = pickcpu(p, 0)) < 0) p->cpu = cpuid();
+    }
+    if (schedpolicy == SCHED_MLFQ) boost(p);
+    p->state = RUNNABLE;
+
+    rq = &cpus[p->cpu].runq;
+    acquire(&rq->lock);
+    if (cpus[p->cpu].idle && (i = pickcpu(p, 1)) >= 0) {
+        // that CPU is asleep with its ticks stopped; an awake
+        // one will get to p within a tick, without waking it.
+        release(&rq->lock);
+        p->cpu = i;
+        rq = &cpus[p->cpu].runq;
+        acquire(&rq->lock);
+    }
+    runqappend(rq, p);
+    rq->n++;
+    // no CPU that may run p is awake: wake the one it is on.
+    // idle() sets c->idle under this lock before it sleeps.
+    if (cpus[p->cpu].idle) cpuwake(p->cpu);
+    release(&rq->lock);
+}
+
+// Unlink p, which follows prev (or is first if prev is 0),
+// from level l of rq. Caller must hold rq->lock.
+static void runqunlink(struct runq *rq, int l, struct proc *prev, struct proc *p) {
+    if (prev) prev->rqnext = p->rqnext;
+    else
+        rq->head[l] = p->rqnext;
+    if (rq->tail[l] == p) rq->tail[l] = prev;
+    rq->n--;
+}
+
+// Take the oldest process of the highest priority that may
+// run on CPU cpu off rq, or return 0 if there is none.
+static struct proc *runqget(struct runq *rq, int cpu) {
+    struct proc *p, *prev, *list;
+    int l;
+
+    acquire(&rq->lock);
+    if (schedpolicy == SCHED_MLFQ && rq->boost != ticks / BOOSTTICKS) {
+        // a priority boost: move everything on the queue up.
+        rq->boost = ticks / BOOSTTICKS;
+        for (l = 1; l < NPRIO; l++) {
+            list = rq->head[l];
+            rq->head[l] = rq->tail[l] = 0;
+            while ((p = list) != 0) {
+                list = p->rqnext;
+                boost(p);
+                runqappend(rq, p);
+            }
+        }
+    }
+    p = 0;
+    for (l = 0; l < NPRIO && p == 0; l++) {
+        prev = 0;
+        for (p = rq->head[l]; p && !(p->affinity & (1L << cpu)); p = p->rqnext)
+            prev = p;
+        if (p) runqunlink(rq, l, prev, p);
+    }
+    release(&rq->lock);
+    return p;
+}
+
+// Take a process that may run on CPU cpu from the longest
+// run queue that has one, for a CPU that has nothing of its
+// own to run.
+static struct proc *runqsteal(int cpu) {
+    struct runq *rq;
+    struct proc *p;
+    uint64 tried = 1L << cpu;
+    int i, n = 0;
+
+    for (;;) {
+        rq = 0;
+        for (i = 0; i < NCPU; i++) {
+            if (!(tried & (1L << i)) && cpus[i].runq.n > 0 && (rq == 0 || cpus[i].runq.n > rq->n)) {
+                rq = &cpus[i].runq;
+                n = i;
+            }
+        }
+        if (rq == 0) return 0;
+        if ((p = runqget(rq, cpu)) != 0) return p;
+        tried |= 1L << n;
     }
 }
 
+// Charge the current process for the clock tick that
+// interrupted it in user space. Returns 1 if it should give
+// up the CPU: always with sched=rr; with sched=mlfq, when it
+// has used up its quantum, which drops it a level, or when a
+// higher-priority process is waiting for this CPU.
+int schedtick(void) {
+    struct proc *p = myproc();
+    struct runq *rq;
+    int l, giveup = 0;
+
+    if (schedpolicy == SCHED_RR) return 1;
+
+    acquire(&p->lock);
+    boost(p);
+    if (++p->used >= (1 << p->prio)) {
+        if (p->prio < NPRIO - 1) p->prio++;
+        p->used = 0;
+        giveup = 1;
+    }
+    // read without the queue's lock, as a hint.
+    rq = &mycpu()->runq;
+    for (l = 0; l < p->prio; l++)
+        if (rq->head[l]) giveup = 1;
+    release(&p->lock);
+    return giveup;
+}
+
+// Add inc to the current process's nice level, the highest
+// priority level it runs at with sched=mlfq, keeping it in
+// [0, NPRIO-1]. Returns the new level.
+int knice(int inc) {
+    struct proc *p = myproc();
+    int n;
+
+    acquire(&p->lock);
+    n = p->nice + inc;
+    if (n < 0) n = 0;
+    if (n > NPRIO - 1) n = NPRIO - 1;
+    p->nice = n;
+    if (schedpolicy == SCHED_MLFQ) {
+        p->prio = n;
+        p->used = 0;
+    }
+    release(&p->lock);
+    return n;
+}
+
+// The CPUs that are running scheduler(), a bit for each.
+static uint64 livecpus(void) {
+    uint64 mask = 0;
+
+    for (int i = 0; i < NCPU; i++)
+        if (cpus[i].live) mask |= 1L << i;
+    return mask;
+}
+
+// Find the process with pid, or the current process if pid is
+// 0, and return it with its lock held; or return 0.
+static struct proc *lockpid(int pid) {
+    struct proc *p;
+
+    if (pid == 0) {
+        p = myproc();
+        acquire(&p->lock);
+        return p;
+    }
+    for (p = proc; p < &proc[NPROC]; p++) {
+        acquire(&p->lock);
+        if (p->pid == pid && p->state != UNUSED) return p;
+        release(&p->lock);
+    }
+    return 0;
+}
+
+// Let process pid (0 for the current one) run only on the CPUs
+// in mask. A RUNNABLE process moves to a queue it may use now;
+// a running one, when it next gives up its CPU, which the
+// current process does at once if it may not stay on this one.
+// returns 0, or -1 if there is no such process or mask has no
+// running CPUs.
+int ksetaffinity(int pid, uint64 mask) {
+    struct proc *p, *q, *prev;
+    struct runq *rq;
+    int self;
+
+    if ((mask &= livecpus()) == 0 || (p = lockpid(pid)) == 0) return -1;
+    p->affinity = mask;
+    self = p == myproc() && !(mask & (1L << cpuid()));
+    if (p->state == RUNNABLE && !(mask & (1L << p->cpu))) {
+        // take it off its queue, unless a scheduler() has just
+        // taken it to run.
+        rq = &cpus[p->cpu].runq;
+        acquire(&rq->lock);
+        prev = 0;
+        for (q = rq->head[p->prio]; q && q != p; q = q->rqnext)
+            prev = q;
+        if (q) runqunlink(rq, p->prio, prev, p);
+        release(&rq->lock);
+        if (q) setrunnable(p);
+    }
+    release(&p->lock);
+    if (self) yield();
+    return 0;
+}
+
+// The mask of CPUs process pid (0 for the current one) may
+// run on, or 0 if there is no such process.
+uint64 kgetaffinity(int pid) {
+    struct proc *p;
+    uint64 mask;
+
+    if ((p = lockpid(pid)) == 0) return 0;
+    mask = p->affinity & livecpus();
+    release(&p->lock);
+    return mask;
+}
+
+// Sleep until an interrupt, with the clock ticks stopped: the
+// next timer interrupt comes at the next pause() or usleep()
+// deadline, or after IDLECYCLES to look for work to steal.
+// A process woken while this CPU sleeps goes on the queue of
+// an awake CPU instead if it may run there, or else wakes this
+// one with an interrupt (see setrunnable()).
+// Called by scheduler() with interrupts off.
+static void idle(struct cpu *c) {
+    uint64 now = r_time(), next;
+
+    // expire timers first: they may make a process RUNNABLE here.
+    next = timerintr(now, now + IDLECYCLES);
+
+    acquire(&c->runq.lock);
+    if (c->runq.n > 0) {
+        release(&c->runq.lock);
+        return;
+    }
+    c->idle = 1;
+    release(&c->runq.lock);
+
+    w_stimecmp(next);
+    asm volatile("wfi");
+
+    acquire(&c->runq.lock);
+    c->idle = 0;
+    release(&c->runq.lock);
+
+    // start ticking again, in case this was a device interrupt.
+    if (r_stimecmp() > c->nexttick) w_stimecmp(c->nexttick);
+}
+
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
@@ -383,6 +1190,7 @@ void scheduler(void) {
     struct cpu *c = mycpu();
 
     c->proc = 0;
+    c->live = 1;
     for (;;) {
         // The most recent process to run may have had interrupts
         // turned off; enable them to avoid a deadlock if all
@@ -392,28 +1200,30 @@ void scheduler(void) {
         intr_on();
         intr_off();
 
-        int found = 0;
-        for (p = proc; p < &proc[NPROC]; p++) {
-            acquire(&p->lock);
-            if (p->state == RUNNABLE) {
-                // Switch to chosen process.  It is the process's job
-                // to release its lock and then reacquire it
-                // before jumping back to us.
-                p->state = RUNNING;
-                c->proc = p;
-                swtch(&c->context, &p->context);
-
-                // Process is done running for now.
-                // It should have changed its p->state before coming back.
-                c->proc = 0;
-                found = 1;
-            }
-            release(&p->lock);
-        }
-        if (found == 0) {
-            // nothing to run; stop running on this core until an interrupt.
-            asm volatile("wfi");
+        if ((p = runqget(&c->runq, c - cpus)) == 0 && (p = runqsteal(c - cpus)) == 0) {
+            // nothing to run; zero a free page for kalloc_zeroed(),
+            // or if there are enough already, stop running on this
+            // core until there is something to do.
+            if (kzeroidle() == 0) idle(c);
+            continue;
         }
+
+        // Switch to chosen process.  It is the process's job
+        // to release its lock and then reacquire it
+        // before jumping back to us. If it was just put on a
+        // queue by yield() on another CPU, this waits until
+        // that CPU has switched away from it.
+        acquire(&p->lock);
+        if (p->state != RUNNABLE) panic("scheduler: not runnable");
+        p->state = RUNNING;
+        p->cpu = c - cpus;
+        c->proc = p;
+        swtch(&c->context, &p->context);
+
+        // Process is done running for now.
+        // It should have changed its p->state before coming back.
+        c->proc = 0;
+        release(&p->lock);
     }
 }
 
@@ -442,7 +1252,7 @@ void scheduleProcess(void) {
 void yield(void) {
     struct proc *p = myproc();
     acquire(&p->lock);
-    p->state = RUNNABLE;
+    setrunnable(p);
     scheduleProcess();
     release(&p->lock);
 }
@@ -477,15 +1287,31 @@ void forkret(void) {
 
     // return to user space, mimicing usertrap()'s return.
     prepare_return();
-    uint64 satp = MAKE_SATP(p->pagetable);
+    uint64 satp = asidsatp(p);
     uint64 trampoline_userret = TRAMPOLINE + (userret - trampoline);
     ((void (*)(uint64))trampoline_userret)(satp);
 }
 
+// The wait queue for channel waitChannel.
+static struct waitq *chanwaitq(void *waitChannel) {
+    return &waitqs[((uint64)waitChannel * 0x9E3779B97F4A7C15ULL) >> 58];
+}
+
 // Sleep on channel waitChannel, releasing condition lock lk.
 // Re-acquires lk when awakened.
 void sleep(void *waitChannel, struct spinlock *lk) {
     struct proc *p = myproc();
+    struct waitq *wq = chanwaitq(waitChannel);
+
+    // Join the channel's wait queue while still holding lk,
+    // so no wakeup() on the channel can have been looking
+    // at the queue yet.
+    acquire(&wq->lock);
+    p->wqnext = wq->head;
+    if (wq->head) wq->head->wqpprev = &p->wqnext;
+    p->wqpprev = &wq->head;
+    wq->head = p;
+    release(&wq->lock);
 
     // Must acquire p->lock in order to
     // change p->state and then call scheduleProcess.
@@ -505,26 +1331,69 @@ void sleep(void *waitChannel, struct spinlock *lk) {
 
     // Tidy up.
     p->waitChannel = 0;
+    release(&p->lock);
+
+    acquire(&wq->lock);
+    *p->wqpprev = p->wqnext;
+    if (p->wqnext) p->wqnext->wqpprev = p->wqpprev;
+    release(&wq->lock);
 
     // Reacquire original lock.
-    release(&p->lock);
     acquire(lk);
 }
 
 // Wake up all processes sleeping on channel waitChannel.
 // Caller should hold the condition lock.
 void wakeup(void *waitChannel) {
+    wakeupn(waitChannel, NPROC);
+}
+
+// Wake up at most n processes sleeping on channel waitChannel.
+// Caller should hold the condition lock.
+// returns how many were woken.
+int wakeupn(void *waitChannel, int n) {
+    struct waitq *wq = chanwaitq(waitChannel);
     struct proc *p;
+    int woken = 0;
 
-    for (p = proc; p < &proc[NPROC]; p++) {
+    // a sleeper joins the queue holding the condition lock,
+    // which the caller holds, so an empty queue needs no lock
+    // to be sure of; most wakeups, like the clock's, find one.
+    if (wq->head == 0) return 0;
+
+    acquire(&wq->lock);
+    for (p = wq->head; p != 0 && woken < n; p = p->wqnext) {
         if (p != myproc()) {
             acquire(&p->lock);
             if (p->state == SLEEPING && p->waitChannel == waitChannel) {
-                p->state = RUNNABLE;
+                setrunnable(p);
+                woken++;
             }
             release(&p->lock);
         }
     }
+    release(&wq->lock);
+    return woken;
+}
+
+// Wake up all processes sleeping on channels from lo up to hi.
+// Caller should hold the channels' condition lock.
+void wakeuprange(void *lo, void *hi) {
+    struct waitq *wq;
+    struct proc *p;
+
+    for (wq = waitqs; wq < &waitqs[NWAITQ]; wq++) {
+        if (wq->head == 0) continue;  // as in wakeupn()
+        acquire(&wq->lock);
+        for (p = wq->head; p != 0; p = p->wqnext) {
+            if (p != myproc()) {
+                acquire(&p->lock);
+                if (p->state == SLEEPING && p->waitChannel >= lo && p->waitChannel < hi) setrunnable(p);
+                release(&p->lock);
+            }
+        }
+        release(&wq->lock);
+    }
 }
 
 // Kill the process with the given pid.
@@ -539,7 +1408,7 @@ int kkill(int pid) {
             p->killed = 1;
             if (p->state == SLEEPING) {
                 // Wake process from sleep().
-                p->state = RUNNABLE;
+                setrunnable(p);
             }
             release(&p->lock);
             return 0;
@@ -18,12 +18,31 @@ struct context {
   uint64 s11;
 };
 
+// A CPU's queue of RUNNABLE processes: a list per priority
+// level, oldest first.
+struct runq {
+  struct spinlock lock;
+  struct proc *head[NPRIO];
+  struct proc *tail[NPRIO];
+  int n;                      // processes on the queue
+  uint boost;                 // last priority boost applied to the lists
+};
+
+enum schedpolicy { SCHED_RR, SCHED_MLFQ };
+
 // Per-CPU state.
 struct cpu {
   struct proc *proc;          // The process running on this cpu, or null.
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  uint64 asidgen;             // ASID generation since the last full TLB flush
+  uint64 nexttick;            // time of this cpu's next clock tick
+  struct runq runq;           // processes waiting to run on this cpu
+  int live;                   // running scheduler(), so runq gets served
+  int idle;                   // asleep with ticks stopped; runq.lock
+  struct proc *user;          // process whose pages it is running in user mode, or 0
+  uint64 usertraps;           // traps taken from user mode, for asidsync()
 };
 
 extern struct cpu cpus[NCPU];
@@ -81,6 +100,21 @@ struct trapframe {
 
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
+// A region of user memory that vmfault() fills in on first
+// touch: a program segment recorded by exec, or an mmap().
+// A slot is free if flags is 0.
+struct vma {
+  uint64 start;                // first address, page-aligned
+  uint64 end;                  // one past the last address
+  int perm;                    // PTE_W and PTE_X bits for its pages
+  int flags;                   // MAP_SHARED or MAP_PRIVATE, maybe MAP_ANONYMOUS
+  uint off;                    // file offset of start
+  uint64 filesz;               // bytes backed by the file; the rest reads as zeros
+  struct inode *ip;            // backing file, or 0 if anonymous
+  int advice;                  // MADV_NORMAL, MADV_RANDOM or MADV_SEQUENTIAL
+  struct shm *shm;             // attached shared memory segment, or 0
+};
+
 // Per-process state
 struct proc { //Process control block(PCB)
   struct spinlock lock; //Any operation that modifies this struct must hold this lock.
@@ -92,19 +126,61 @@ struct proc { //Process control block(PCB)
   int killed;                  // If non-zero, have been killed
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
+  int cpu;                     // CPU whose run queue it goes on, or -1
+  uint64 affinity;             // CPUs it may run on, a bit for each
+
+  int nice;                    // highest priority level it may run at
+  int nthreads;                // in a first thread, how many others it has
+
+  // the lock of the wait queue it is on must be held when using these:
+  struct proc *wqnext;         // next process on the same wait queue
+  struct proc **wqpprev;       // pointer to this process in that queue
+
+  // the timer wheel's lock must be held when using these:
+  uint64 tmdue;                // pause() deadline, in timer units, or 0
+  int tmlevel;                 // timer wheel level it is on
+  struct proc *tmnext;         // next process in the same wheel slot
+  struct proc **tmpprev;       // pointer to this process in that slot
+
+  // p->lock, or the lock of the run queue it is on, must be
+  // held when using these:
+  struct proc *rqnext;         // next process on the same run queue
+  int prio;                    // priority level, 0 (highest) to NPRIO-1
+  int used;                    // ticks used at this priority level
+  uint boost;                  // last priority boost applied
 
   // wait_lock must be held when using this:
   struct proc *parent;         // Parent process()
 
+  // A process may have several threads, each a struct proc of
+  // its own with the same page table. The first thread holds what
+  // they share: the fields from sz to swaphand, ofile and cwd are
+  // used as p->group->sz and so on, and are unused in the others.
+  // Set at allocation, and constant until freed.
+  struct proc *group;          // the process's first thread; itself in that one
+  uint64 trapframeva;          // user address trapframe is mapped at
+
   // these are private to the process, so p->lock need not be held.
   uint64 kstack;               // Virtual address of kernel stack
   uint64 sz;                   // Size of process memory (bytes),indicates the top of the user heap, modified by sbrk()
   pagetable_t pagetable;       // User page table
+  uint64 asid;                 // ASID tagging pagetable's TLB entries, generation above
+  uint64 tlbcpus;              // CPUs that may hold TLB entries for asid
+  uint64 tlbstale;             // CPUs whose TLB entries for asid may be stale
   struct trapframe *trapframe; // data page for trampoline.S(Mode switch)
+  struct usyscall *usyscall;   // read-only page at USYSCALL for ulib.c
   //(switch form User to kernel,like syscall) still belong to this process,"what I am doing before enter kernel"
   struct context context;      // swtch() here to run process(Process switch)
   //(switch form kernel to kernel)switch to new process, "what I am doing before yield the CPU to the scheduler"
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
+  struct vma vma[NVMA];        // Mapped memory regions
+  int heapadvice;              // madvise() advice for the lazily allocated heap
+  uint64 faultnext;            // page after those the last heap fault mapped
+  int faultwin;                // pages the last heap fault mapped
+  uint64 swaphand;             // where uvmevict() looks for a victim next
+  int swapok;                  // pages may be paged out while not running
   char name[16];               // Process name (debugging)
 };
+
+extern struct proc proc[NPROC];
@@ -76,9 +76,12 @@ w_sip(uint64 x)
   asm volatile("csrw sip, %0" : : "r" (x));
 }
 
+#define SIP_SSIP (1L << 1) // software interrupt pending
+
 // Supervisor Interrupt Enable
 #define SIE_SEIE (1L << 9) // external
 #define SIE_STIE (1L << 5) // timer
+#define SIE_SSIE (1L << 1) // software
 static inline uint64
 r_sie()
 {
@@ -95,6 +98,7 @@ w_sie(uint64 x)
 
 // Machine-mode Interrupt Enable
 #define MIE_STIE (1L << 5)  // supervisor timer
+#define MIE_MSIE (1L << 3)  // machine software
 static inline uint64
 r_mie()
 {
@@ -172,6 +176,14 @@ r_stvec()
   return x;
 }
 
+// Supervisor Scratch register, for the trampoline:
+// the user address of the current thread's trapframe.
+static inline void 
+w_sscratch(uint64 x)
+{
+  asm volatile("csrw sscratch, %0" : : "r" (x));
+}
+
 // Supervisor Timer Comparison Register
 static inline uint64
 r_stimecmp()
@@ -206,6 +218,20 @@ w_menvcfg(uint64 x)
   asm volatile("csrw 0x30a, %0" : : "r" (x));
 }
 
+// Machine-mode interrupt vector
+static inline void
+w_mtvec(uint64 x)
+{
+  asm volatile("csrw mtvec, %0" : : "r" (x));
+}
+
+// Machine Scratch register, for mswvec.
+static inline void
+w_mscratch(uint64 x)
+{
+  asm volatile("csrw mscratch, %0" : : "r" (x));
+}
+
 // Physical Memory Protection
 static inline void
 w_pmpcfg0(uint64 x)
@@ -224,6 +250,11 @@ w_pmpaddr0(uint64 x)
 
 #define MAKE_SATP(pagetable) (SATP_SV39 | (((uint64)pagetable) >> 12))
 
+// the address-space identifier field of satp, which tags
+// TLB entries. ASID 0 is the kernel's.
+#define SATP_ASID(asid) (((uint64)(asid) & 0xFFFF) << 44)
+#define SATP2ASID(satp) (((satp) >> 44) & 0xFFFF)
+
 // supervisor address translation and protection;
 // holds the address of the page table.
 static inline void 
@@ -273,6 +304,21 @@ r_mcounteren()
   return x;
 }
 
+// Supervisor-mode Counter-Enable
+static inline void 
+w_scounteren(uint64 x)
+{
+  asm volatile("csrw scounteren, %0" : : "r" (x));
+}
+
+static inline uint64
+r_scounteren()
+{
+  uint64 x;
+  asm volatile("csrr %0, scounteren" : "=r" (x) );
+  return x;
+}
+
 // machine-mode cycle counter
 static inline uint64
 r_time()
@@ -352,6 +398,20 @@ sfence_vma()
   asm volatile("sfence.vma zero, zero");
 }
 
+// flush the TLB entries of one address space.
+static inline void
+sfence_vma_asid(uint64 asid)
+{
+  asm volatile("sfence.vma zero, %0" : : "r" (asid));
+}
+
+// flush an address space's TLB entries for virtual address va.
+static inline void
+sfence_vma_page(uint64 va, uint64 asid)
+{
+  asm volatile("sfence.vma %0, %1" : : "r" (va), "r" (asid));
+}
+
 typedef uint64 pte_t;
 typedef uint64 *pagetable_t; // 512 PTEs
 
@@ -360,11 +420,11 @@ typedef uint64 *pagetable_t; // 512 PTEs
 #define PGSIZE 4096 // bytes per page
 #define PGSHIFT 12  // bits of offset within a page
 
-#ifdef LAB_PGTBL
-#define SUPERPGSIZE (2 * (1 << 20)) // bytes per page
+// a superpage is mapped by a level-1 leaf PTE.
+#define SUPERPGSIZE (2 * (1 << 20)) // bytes per superpage
+#define SUPERPGORDER 9              // log2(SUPERPGSIZE / PGSIZE)
 #define SUPERPGROUNDUP(sz)  (((sz)+SUPERPGSIZE-1) & ~(SUPERPGSIZE-1))
-#define SUPERPGROUNDDOWN(sz) (SUPERPGROUNDUP(sz)-SUPERPGSIZE)
-#endif
+#define SUPERPGROUNDDOWN(a) (((a)) & ~(SUPERPGSIZE-1))
 
 #define PGROUNDUP(sz)  (((sz)+PGSIZE-1) & ~(PGSIZE-1))
 #define PGROUNDDOWN(a) (((a)) & ~(PGSIZE-1))
@@ -374,12 +434,15 @@ typedef uint64 *pagetable_t; // 512 PTEs
 #define PTE_W (1L << 2)
 #define PTE_X (1L << 3)
 #define PTE_U (1L << 4) // user can access
+#define PTE_A (1L << 6) // accessed: used since the bit was cleared
+#define PTE_D (1L << 7) // dirty: written since mapped
+#define PTE_COW (1L << 8) // copy-on-write (RSW bit; ignored by hardware)
+#define PTE_S (1L << 9) // swapped out; not valid, and holds a swap slot (RSW bit)
 
 
-
-#if defined(LAB_MMAP) || defined(LAB_PGTBL) || defined(LAB_COW)
+// a valid PTE with any of R, W, X set is a leaf; otherwise it
+// points to the next level of the page table.
 #define PTE_LEAF(pte) (((pte) & PTE_R) | ((pte) & PTE_W) | ((pte) & PTE_X))
-#endif
 
 // shift a physical address to the right place for a PTE.
 #define PA2PTE(pa) ((((uint64)pa) >> 12) << 10)
@@ -388,6 +451,10 @@ typedef uint64 *pagetable_t; // 512 PTEs
 
 #define PTE_FLAGS(pte) ((pte) & 0x3FF)
 
+// the swap slot of a swapped-out page, in place of its PPN.
+#define SLOT2PTE(slot) (((uint64)slot) << 10)
+#define PTE2SLOT(pte) ((uint)((pte) >> 10))
+
 // extract the three 9-bit page table indices from a virtual address.
 #define PXMASK          0x1FF // 9 bits
 #define PXSHIFT(level)  (PGSHIFT+(9*(level)))
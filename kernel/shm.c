@@ -0,0 +1,260 @@
+// Shared memory segments.
+//
+// shmget() creates a segment of zeroed pages, or finds the one
+// made earlier with the same key, and shmat() maps the segment's
+// pages into the caller at an address it chooses (or one picked
+// like mmap() picks). Every process that attaches a segment maps
+// the same physical pages, so writes by one are seen by the others
+// without copying.
+//
+// An attachment is a MAP_SHARED anonymous region whose vma->shm
+// points at the segment. Each attachment, including the ones fork
+// copies, holds a reference to the segment; the last shmdt(),
+// munmap() or exit frees it. A segment nobody has attached yet
+// stays until someone does or shmctl(IPC_RMID) removes it. Each
+// mapping of a page also holds a reference to the page, so
+// uvmevict() never pages them out.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+#include "fcntl.h"
+
+struct shm {
+  int key;        // 0 for a private or removed segment
+  int ref;        // attachments
+  int npages;     // 0 if this slot is free
+  uint64 *pages;  // physical address of each page; 0 while shmget() makes them
+};
+
+struct {
+  struct spinlock lock;
+  struct shm seg[NSHM];
+} shm;
+
+void
+shminit(void)
+{
+  initlock(&shm.lock, "shm");
+}
+
+// Free the pages of a segment that is no longer in the table.
+static void
+shmfree(uint64 *pages, int npages)
+{
+  for(int i = 0; i < npages; i++)
+    if(pages[i])
+      kfree((void*)pages[i]);
+  kmfree(pages);
+}
+
+// Return the id of the segment with key, creating it with size
+// bytes if there is none, or if key is 0.
+// returns -1 if size is too large, larger than an existing
+// segment, or there is no memory or free segment.
+int
+shmget(int key, uint64 size)
+{
+  uint64 *pages = 0;
+  int i, j, n;
+
+  if(size == 0 || size > SHMPAGES*PGSIZE)
+    return -1;
+  n = PGROUNDUP(size) / PGSIZE;
+
+  acquire(&shm.lock);
+ again:
+  for(i = 0; key && i < NSHM; i++){
+    if(shm.seg[i].npages && shm.seg[i].key == key){
+      if(shm.seg[i].pages == 0){
+        // another shmget() is creating it.
+        sleep(&shm.seg[i], &shm.lock);
+        goto again;
+      }
+      if(n > shm.seg[i].npages)
+        i = -1;
+      release(&shm.lock);
+      return i;
+    }
+  }
+  // reserve a slot, with no pages yet, for the key.
+  for(i = 0; i < NSHM; i++)
+    if(shm.seg[i].npages == 0)
+      break;
+  if(i == NSHM){
+    release(&shm.lock);
+    return -1;
+  }
+  shm.seg[i].key = key;
+  shm.seg[i].ref = 0;
+  shm.seg[i].npages = n;
+  shm.seg[i].pages = 0;
+  release(&shm.lock);
+
+  // allocate the pages without the lock, since
+  // kalloc_user() may sleep paging other memory out.
+  if((pages = kmalloc(n * sizeof(uint64))) != 0){
+    memset(pages, 0, n * sizeof(uint64));
+    for(j = 0; j < n; j++){
+      if((pages[j] = (uint64)kalloc_user(1)) == 0){
+        shmfree(pages, n);
+        pages = 0;
+        break;
+      }
+    }
+  }
+
+  acquire(&shm.lock);
+  wakeup(&shm.seg[i]);
+  shm.seg[i].pages = pages;
+  if(pages == 0){
+    shm.seg[i].npages = 0;
+    i = -1;
+  }
+  release(&shm.lock);
+  return i;
+}
+
+// Remove segment id: its key no longer finds it, and it is
+// freed now if nothing has it attached, or else at the last
+// detach.
+// returns 0, or -1 if there is no such segment.
+int
+shmrm(int id)
+{
+  struct shm *s;
+  uint64 *pages;
+  int n;
+
+  if(id < 0 || id >= NSHM)
+    return -1;
+  s = &shm.seg[id];
+  acquire(&shm.lock);
+  if(s->npages == 0 || s->pages == 0){
+    release(&shm.lock);
+    return -1;
+  }
+  s->key = 0;
+  if(s->ref > 0){
+    release(&shm.lock);
+    return 0;
+  }
+  pages = s->pages;
+  n = s->npages;
+  s->pages = 0;
+  s->npages = 0;
+  release(&shm.lock);
+  shmfree(pages, n);
+  return 0;
+}
+
+// Map segment id into p at addr, or wherever there is room
+// if addr is 0. The region must lie between the heap and
+// MMAPTOP and overlap no other region.
+// returns the address, or -1 on error.
+uint64
+shmat(struct proc *p, int id, uint64 addr)
+{
+  struct vma *v, *nv = 0;
+  struct shm *s;
+  uint64 len;
+  int i;
+
+  if(id < 0 || id >= NSHM || addr % PGSIZE != 0)
+    return -1;
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->flags == 0){
+      nv = v;
+      break;
+    }
+  }
+  if(nv == 0)
+    return -1;
+
+  s = &shm.seg[id];
+  acquire(&shm.lock);
+  if(s->npages == 0 || s->pages == 0)
+    goto bad;
+  len = (uint64)s->npages * PGSIZE;
+  if(addr == 0){
+    if((addr = mmapalloc(p, len)) == 0)
+      goto bad;
+  } else {
+    if(addr < PGROUNDUP(p->sz) || addr + len < addr || addr + len > MMAPTOP)
+      goto bad;
+    for(v = p->vma; v < &p->vma[NVMA]; v++)
+      if(v->flags && v->start < addr + len && addr < v->end)
+        goto bad;
+  }
+  for(i = 0; i < s->npages; i++){
+    if(mappages(p->pagetable, addr + i*PGSIZE, PGSIZE, s->pages[i], PTE_R|PTE_W|PTE_U) != 0){
+      uvmunmap(p->pagetable, addr, i, 1);
+      goto bad;
+    }
+    krefinc((void*)s->pages[i]);
+  }
+  s->ref++;
+  release(&shm.lock);
+
+  nv->start = addr;
+  nv->end = addr + len;
+  nv->perm = PTE_W;
+  nv->flags = MAP_SHARED | MAP_ANONYMOUS;
+  nv->shm = s;
+  return addr;
+
+ bad:
+  release(&shm.lock);
+  return -1;
+}
+
+// Unmap the segment attached at addr in p.
+// returns 0 on success, -1 if no segment is attached there.
+int
+shmdt(struct proc *p, uint64 addr)
+{
+  struct vma *v;
+
+  if((v = vmalookup(p, addr)) == 0 || v->shm == 0 || v->start != addr)
+    return -1;
+  vmaunmap(p->pagetable, v, v->start, v->end);
+  return 0;
+}
+
+// Add a reference to s, for an attachment copied by fork.
+void
+shmdup(struct shm *s)
+{
+  acquire(&shm.lock);
+  if(s->ref < 1)
+    panic("shmdup");
+  s->ref++;
+  release(&shm.lock);
+}
+
+// Drop a reference to s, for an attachment that is gone,
+// freeing the segment if it was the last.
+void
+shmput(struct shm *s)
+{
+  uint64 *pages;
+  int n;
+
+  acquire(&shm.lock);
+  if(s->ref < 1)
+    panic("shmput");
+  if(--s->ref > 0){
+    release(&shm.lock);
+    return;
+  }
+  pages = s->pages;
+  n = s->npages;
+  s->pages = 0;
+  s->npages = 0;
+  release(&shm.lock);
+  shmfree(pages, n);
+}
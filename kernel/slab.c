@@ -0,0 +1,252 @@
+// Slab allocator for small kernel objects.
+//
+// A kcache hands out fixed-size objects carved out of whole pages
+// from kalloc() ("slabs"). Each slab page starts with a struct slab
+// header followed by as many objects as fit, so kcache_free() and
+// kmfree() can find an object's slab, and thus its cache, by
+// rounding the object's address down to a page boundary.
+//
+// Each CPU keeps a small magazine of free objects per cache.
+// kcache_alloc() and kcache_free() normally just pop or push the
+// calling CPU's magazine with interrupts off and take no lock;
+// the cache lock is only taken to move MAGSIZE/2 objects between
+// a magazine and the slabs.
+//
+// kmalloc()/kmfree() allocate from a set of power-of-two sized
+// caches for callers that do not have a cache of their own.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+
+#define NKCACHE 16   // maximum number of caches
+#define MAGSIZE 16   // objects per per-CPU magazine
+
+struct object {
+  struct object *next;
+};
+
+struct slab {
+  struct kcache *cache;
+  struct slab *next;       // on cache's list of slabs with free objects
+  struct slab *prev;
+  struct object *free;     // free objects in this slab
+  int inuse;               // objects handed out (including those in magazines)
+};
+
+struct kcache {
+  struct spinlock lock;
+  char *name;
+  uint size;               // object size, rounded up to 8 bytes
+  int perslab;             // objects per slab
+  struct slab partial;     // circular list of slabs with free objects
+  int nslab;               // slabs owned by this cache
+  int nempty;              // slabs on the partial list with inuse == 0
+  struct {
+    int n;
+    void *obj[MAGSIZE];
+  } mag[NCPU];
+};
+
+struct {
+  struct spinlock lock;
+  struct kcache cache[NKCACHE];
+  int n;
+} kcaches;
+
+// kmalloc() size classes.
+static int kmsizes[] = { 32, 64, 128, 256, 512, 1024, 2048 };
+static struct kcache *kmcache[NELEM(kmsizes)];
+
+void
+slabinit(void)
+{
+  static char *names[] = {
+    "kmalloc-32", "kmalloc-64", "kmalloc-128", "kmalloc-256",
+    "kmalloc-512", "kmalloc-1024", "kmalloc-2048",
+  };
+
+  initlock(&kcaches.lock, "kcaches");
+  for(int i = 0; i < NELEM(kmsizes); i++)
+    kmcache[i] = kcache_create(names[i], kmsizes[i]);
+}
+
+// Create a cache of objects of the given size.
+// name must remain valid for the life of the kernel.
+struct kcache*
+kcache_create(char *name, uint size)
+{
+  struct kcache *c;
+
+  size = (size + 7) & ~7;
+  if(size < sizeof(struct object) || sizeof(struct slab) + size > PGSIZE)
+    panic("kcache_create: size");
+
+  acquire(&kcaches.lock);
+  if(kcaches.n >= NKCACHE)
+    panic("kcache_create: too many caches");
+  c = &kcaches.cache[kcaches.n++];
+  release(&kcaches.lock);
+
+  initlock(&c->lock, name);
+  c->name = name;
+  c->size = size;
+  c->perslab = (PGSIZE - sizeof(struct slab)) / size;
+  c->partial.next = c->partial.prev = &c->partial;
+  c->nslab = 0;
+  c->nempty = 0;
+  for(int i = 0; i < NCPU; i++)
+    c->mag[i].n = 0;
+  return c;
+}
+
+// Allocate a fresh slab for c and put it on the partial list.
+// Caller must hold c->lock.
+// Returns 0 if out of memory.
+static struct slab*
+grow(struct kcache *c)
+{
+  struct slab *s;
+  char *obj;
+
+  if((s = (struct slab*)kalloc()) == 0)
+    return 0;
+  s->cache = c;
+  s->inuse = 0;
+  s->free = 0;
+  obj = (char*)s + sizeof(struct slab);
+  for(int i = 0; i < c->perslab; i++, obj += c->size){
+    ((struct object*)obj)->next = s->free;
+    s->free = (struct object*)obj;
+  }
+  s->next = c->partial.next;
+  s->prev = &c->partial;
+  c->partial.next->prev = s;
+  c->partial.next = s;
+  c->nslab++;
+  c->nempty++;
+  return s;
+}
+
+// Move up to n objects from c's slabs into pa[].
+// Caller must hold c->lock.
+// Returns the number of objects moved.
+static int
+takeobjs(struct kcache *c, void **pa, int n)
+{
+  struct slab *s;
+  int i = 0;
+
+  while(i < n){
+    s = c->partial.next;
+    if(s == &c->partial && (s = grow(c)) == 0)
+      break;
+    if(s->inuse == 0)
+      c->nempty--;
+    while(i < n && s->free){
+      pa[i++] = s->free;
+      s->free = s->free->next;
+      s->inuse++;
+    }
+    if(s->free == 0){
+      // full: take it off the partial list.
+      s->prev->next = s->next;
+      s->next->prev = s->prev;
+    }
+  }
+  return i;
+}
+
+// Return n objects from pa[] to their slabs, releasing
+// slabs that become empty if c already has one empty slab.
+// Caller must hold c->lock.
+static void
+putobjs(struct kcache *c, void **pa, int n)
+{
+  struct slab *s;
+  struct object *o;
+
+  for(int i = 0; i < n; i++){
+    o = (struct object*)pa[i];
+    s = (struct slab*)PGROUNDDOWN((uint64)o);
+    if(s->free == 0){
+      // was full: back on the partial list.
+      s->next = c->partial.next;
+      s->prev = &c->partial;
+      c->partial.next->prev = s;
+      c->partial.next = s;
+    }
+    o->next = s->free;
+    s->free = o;
+    if(--s->inuse == 0){
+      if(c->nempty > 0){
+        s->prev->next = s->next;
+        s->next->prev = s->prev;
+        c->nslab--;
+        kfree(s);
+      } else {
+        c->nempty++;
+      }
+    }
+  }
+}
+
+// Allocate an object from cache c.
+// Returns 0 if out of memory.
+void*
+kcache_alloc(struct kcache *c)
+{
+  void *obj = 0;
+
+  push_off();
+  int id = cpuid();
+  if(c->mag[id].n == 0){
+    acquire(&c->lock);
+    c->mag[id].n = takeobjs(c, c->mag[id].obj, MAGSIZE/2);
+    release(&c->lock);
+  }
+  if(c->mag[id].n > 0)
+    obj = c->mag[id].obj[--c->mag[id].n];
+  pop_off();
+  return obj;
+}
+
+// Free an object allocated from cache c.
+void
+kcache_free(struct kcache *c, void *obj)
+{
+  if(((struct slab*)PGROUNDDOWN((uint64)obj))->cache != c)
+    panic("kcache_free");
+
+  push_off();
+  int id = cpuid();
+  if(c->mag[id].n == MAGSIZE){
+    acquire(&c->lock);
+    putobjs(c, c->mag[id].obj + MAGSIZE/2, MAGSIZE/2);
+    release(&c->lock);
+    c->mag[id].n = MAGSIZE/2;
+  }
+  c->mag[id].obj[c->mag[id].n++] = obj;
+  pop_off();
+}
+
+// Allocate n bytes from the smallest kmalloc cache that fits.
+// Returns 0 if n is too large or memory is exhausted.
+void*
+kmalloc(uint n)
+{
+  for(int i = 0; i < NELEM(kmsizes); i++)
+    if(n <= kmsizes[i])
+      return kcache_alloc(kmcache[i]);
+  return 0;
+}
+
+// Free memory returned by kmalloc().
+void
+kmfree(void *p)
+{
+  kcache_free(((struct slab*)PGROUNDDOWN((uint64)p))->cache, p);
+}
@@ -1,4 +1,13 @@
 // Mutual exclusion spin locks.
+//
+// Each lock counts its acquisitions, how many of them had to
+// spin and for how long, and how long it was held, for the
+// lockstat device. Locks come and go with the structures they
+// are in (a pipe's, a slab cache's), so the counts are kept per
+// lock name, for all the locks initlock() gave that name; each
+// CPU keeps its own, updated with interrupts off, so that
+// counting doesn't make locks that are never shared bounce
+// between caches.
 
 #include "types.h"
 #include "param.h"
@@ -7,6 +16,47 @@
 #include "riscv.h"
 #include "proc.h"
 #include "defs.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "ioctl.h"
+#include "lockstat.h"
+
+#define NLOCKCLASS 64  // lock names counted; the rest go in "other"
+
+static struct {
+  uint locked;               // a bare flag: the table can't use a spinlock
+  int n;
+  char *name[NLOCKCLASS];
+} lockclass = { .n = 1, .name = { "other" } };
+
+static struct lockstat lockstats[NCPU][NLOCKCLASS];
+
+// the lockstats[][] index for name.
+static int
+classof(char *name)
+{
+  int i;
+
+  push_off();
+  while(__sync_lock_test_and_set(&lockclass.locked, 1) != 0)
+    ;
+  for(i = 1; i < lockclass.n; i++)
+    if(lockclass.name[i] == name || strncmp(lockclass.name[i], name, sizeof(lockstats[0][0].name)) == 0)
+      break;
+  if(i == lockclass.n){
+    if(i < NLOCKCLASS){
+      // lockstatread() looks at the table without the flag.
+      lockclass.name[i] = name;
+      __sync_synchronize();
+      lockclass.n++;
+    } else
+      i = 0;
+  }
+  __sync_lock_release(&lockclass.locked);
+  pop_off();
+  return i;
+}
 
 void
 initlock(struct spinlock *lk, char *name)
@@ -14,6 +64,7 @@ initlock(struct spinlock *lk, char *name)
   lk->name = name;
   lk->locked = 0;
   lk->cpu = 0;
+  lk->class = classof(name);
 }
 
 // Acquire the lock.
@@ -21,6 +72,9 @@ initlock(struct spinlock *lk, char *name)
 void
 acquire(struct spinlock *lk)
 {
+  struct lockstat *st;
+  uint64 spins = 0;
+
   push_off(); // disable interrupts to avoid deadlock.
   if(holding(lk))
     panic("acquire");
@@ -30,7 +84,7 @@ acquire(struct spinlock *lk)
   //   s1 = &lk->locked
   //   amoswap.w.aq a5, a5, (s1)
   while(__sync_lock_test_and_set(&lk->locked, 1) != 0)
-    ;
+    spins++;
 
   // Tell the C compiler and the processor to not move loads or stores
   // past this point, to ensure that the critical section's memory
@@ -40,15 +94,33 @@ acquire(struct spinlock *lk)
 
   // Record info about lock acquisition for holding() and debugging.
   lk->cpu = mycpu();
+
+  st = &lockstats[cpuid()][lk->class];
+  st->acquire++;
+  if(spins){
+    st->contend++;
+    st->spin += spins;
+  }
+  lk->acquired = r_time();
 }
 
 // Release the lock.
 void
 release(struct spinlock *lk)
 {
+  struct lockstat *st;
+  uint64 held;
+
   if(!holding(lk))
     panic("release");
 
+  // interrupts have been off since acquire(), so this is
+  // the CPU that acquired it.
+  held = r_time() - lk->acquired;
+  st = &lockstats[cpuid()][lk->class];
+  if(held > st->maxhold)
+    st->maxhold = held;
+
   lk->cpu = 0;
 
   // Tell the C compiler and the CPU to not move loads or stores
@@ -111,3 +183,46 @@ pop_off(void)
   if(c->noff == 0 && c->intena)
     intr_on();
 }
+
+// The lockstat device: reading it gives a struct lockstat for
+// each lock name, summed over the CPUs; LOCKSTAT_RESET zeroes
+// the counts.
+
+static int
+lockstatread(int user_dst, uint64 dst, int n, uint off)
+{
+  struct lockstat st;
+  int i, c, r = 0;
+
+  for(i = off / sizeof(st); i < lockclass.n && r + sizeof(st) <= n; i++){
+    memset(&st, 0, sizeof(st));
+    safestrcpy(st.name, lockclass.name[i], sizeof(st.name));
+    for(c = 0; c < NCPU; c++){
+      st.acquire += lockstats[c][i].acquire;
+      st.contend += lockstats[c][i].contend;
+      st.spin += lockstats[c][i].spin;
+      if(lockstats[c][i].maxhold > st.maxhold)
+        st.maxhold = lockstats[c][i].maxhold;
+    }
+    if(either_copyout(user_dst, dst + r, &st, sizeof(st)) < 0)
+      return -1;
+    r += sizeof(st);
+  }
+  return r;
+}
+
+static int
+lockstatioctl(int request, uint64 addr)
+{
+  if(request != LOCKSTAT_RESET)
+    return -1;
+  memset(lockstats, 0, sizeof(lockstats));
+  return 0;
+}
+
+void
+lockstatinit(void)
+{
+  devsw[LOCKSTAT].read = lockstatread;
+  devsw[LOCKSTAT].ioctl = lockstatioctl;
+}
@@ -5,5 +5,9 @@ struct spinlock {
   // For debugging:
   char *name;        // Name of lock.
   struct cpu *cpu;   // The cpu holding the lock.
+
+  // For lock statistics:
+  int class;         // lockstats[][] index of the lock's name
+  uint64 acquired;   // time CSR when acquired
 };
 
@@ -6,12 +6,22 @@
 
 void main();
 void timerinit();
+void mswvec();
 
 // entry.S needs one stack per CPU.
 __attribute__((aligned(16))) char stack0[4096 * NCPU];
 
+// scratch space for mswvec in kernelvec.S, one per CPU.
+uint64 mswscratch[NCPU][2];
+
+// physical address of the flattened device tree qemu passes
+// to each hart, for main() to find the boot arguments in.
+uint64 fdtaddr;
+
 // entry.S jumps here in machine mode on stack0.
-void start() {
+void start(uint64 hartid, uint64 fdt) {
+    fdtaddr = fdt;
+
     // set M Previous Privilege mode to Supervisor, for mret.
     unsigned long x = r_mstatus();  // So when we execute mret, we will return to S-mode
     x &= ~MSTATUS_MPP_MASK;
@@ -28,7 +38,7 @@ void start() {
     // delegate all interrupts and exceptions to supervisor mode.
     w_medeleg(0xffff);
     w_mideleg(0xffff);
-    w_sie(r_sie() | SIE_SEIE | SIE_STIE);
+    w_sie(r_sie() | SIE_SEIE | SIE_STIE | SIE_SSIE);
 
     // configure Physical Memory Protection to give supervisor mode
     // access to all of physical memory.
@@ -38,6 +48,12 @@ void start() {
     // ask for clock interrupts.
     timerinit();
 
+    // take machine software interrupts, which other CPUs send
+    // to wake this one, and pass them on to supervisor mode.
+    w_mscratch((uint64)mswscratch[r_mhartid()]);
+    w_mtvec((uint64)mswvec);
+    w_mie(r_mie() | MIE_MSIE);
+
     // keep each CPU's hartid in its tp register, for cpuid().
     int id = r_mhartid();
     w_tp(id);
@@ -57,6 +73,9 @@ void timerinit() {
     // allow supervisor to use stimecmp and time.
     w_mcounteren(r_mcounteren() | 2);
 
+    // and user code to read time, for the usyscall page's time base.
+    w_scounteren(r_scounteren() | 2);
+
     // ask for the very first timer interrupt.
-    w_stimecmp(r_time() + 1000000);
+    w_stimecmp(r_time() + TICKCYCLES);
 }
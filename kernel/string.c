@@ -34,8 +34,15 @@ void *memmove(void *dst, const void *src, uint n) {
         s += n;
         d += n;
         while (n-- > 0) *--d = *--s;
-    } else
+    } else {
+        // copy a word at a time when src and dst are equally aligned,
+        // as page-sized copies in and out of user memory usually are.
+        if ((((uint64)s ^ (uint64)d) & 7) == 0) {
+            while (n > 0 && ((uint64)d & 7) != 0) n--, *d++ = *s++;
+            for (; n >= 8; n -= 8, d += 8, s += 8) *(uint64 *)d = *(const uint64 *)s;
+        }
         while (n-- > 0) *d++ = *s++;
+    }
 
     return dst;
 }
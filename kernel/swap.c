@@ -0,0 +1,156 @@
+// Swap space.
+//
+// When there is no free memory for a user page, kalloc_user()
+// pages out cold user pages to the swap area that mkfs leaves
+// after the file system, and vmfault() reads them back in when
+// they are touched again.
+//
+// A paged-out page's PTE is invalid, with PTE_S set and the swap
+// slot in place of the physical page number; its other bits are
+// kept. fork shares a paged-out page by copying the PTE, so each
+// slot has a reference count.
+//
+// uvmevict() in vm.c picks the victims. A process's page table
+// is only changed while the process can't be using it: either
+// the process is the one asking for memory, or it is not running
+// and has set p->swapok to say that it was stopped somewhere it
+// holds no pointers into its own page table or user pages (when
+// preempted in user space, or waiting in pause() or wait()). In a
+// process with several threads, groupstop() checks this of each.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "defs.h"
+#include "fs.h"
+
+#define SWAPBATCH 8  // pages paged out per shortage
+
+struct {
+  struct spinlock lock;  // protects ref[]
+  struct sleeplock io;   // held from taking a page until it is on disk
+  uint start;            // first block of the swap area
+  uint n;                // number of slots
+  uchar ref[SWAPPAGES];  // references to each slot; 0 if free
+  int hand;              // where swapout() starts looking next
+} swap;
+
+void
+swapinit(struct superblock *sb)
+{
+  initlock(&swap.lock, "swap");
+  initsleeplock(&swap.io, "swapio");
+  swap.start = sb->swapstart;
+  swap.n = sb->nswap < SWAPPAGES ? sb->nswap : SWAPPAGES;
+}
+
+// Allocate a swap slot. Returns -1 if swap is full.
+static int
+slotalloc(void)
+{
+  acquire(&swap.lock);
+  for(int i = 0; i < swap.n; i++){
+    if(swap.ref[i] == 0){
+      swap.ref[i] = 1;
+      release(&swap.lock);
+      return i;
+    }
+  }
+  release(&swap.lock);
+  return -1;
+}
+
+// Add a reference to slot, for a PTE copied by fork.
+void
+swapdup(uint slot)
+{
+  acquire(&swap.lock);
+  if(slot >= swap.n || swap.ref[slot] == 0 || swap.ref[slot] == 255)
+    panic("swapdup");
+  swap.ref[slot]++;
+  release(&swap.lock);
+}
+
+// Drop a reference to slot, freeing it if that was the last.
+void
+swapfree(uint slot)
+{
+  acquire(&swap.lock);
+  if(slot >= swap.n || swap.ref[slot] == 0)
+    panic("swapfree");
+  swap.ref[slot]--;
+  release(&swap.lock);
+}
+
+// Read the page in slot into pa.
+void
+swapread(uint slot, void *pa)
+{
+  // wait for the page to get to the disk, if it is still
+  // on its way out.
+  acquiresleep(&swap.io);
+  virtio_disk_rwpage(pa, swap.start + slot*BPPAGE, 0);
+  releasesleep(&swap.io);
+}
+
+// Page out up to SWAPBATCH cold user pages, taking them from
+// the processes in turn, the caller included.
+// Returns the number of pages paged out.
+static int
+swapout(void)
+{
+  struct proc *q;
+  int i, n, slot;
+  uint64 pa;
+
+  if(swap.n == 0 || myproc() == 0)
+    return 0;
+
+  acquiresleep(&swap.io);
+  for(i = n = 0; i < NPROC && n < SWAPBATCH; ){
+    if((slot = slotalloc()) < 0)
+      break;
+    q = &proc[(swap.hand + i) % NPROC];
+    pa = 0;
+    acquire(&q->lock);
+    if(q->group == q && groupstop(q)){
+      pa = uvmevict(q, slot);
+      groupresume(q);
+    }
+    release(&q->lock);
+    if(pa == 0){
+      swapfree(slot);
+      i++;
+      continue;
+    }
+    virtio_disk_rwpage((void*)pa, swap.start + slot*BPPAGE, 1);
+    kfree((void*)pa);
+    n++;
+  }
+  swap.hand = (swap.hand + 1) % NPROC;
+  releasesleep(&swap.io);
+  return n;
+}
+
+// Allocate a page for user memory, zeroed if zero is set,
+// paging out other user pages if no memory is free.
+// May sleep, and may page out the caller's own pages, so the
+// caller must hold no spinlocks, and must not be holding on to
+// any of its own PTEs or user pages' physical addresses.
+// Returns 0 if out of both memory and swap.
+void *
+kalloc_user(int zero)
+{
+  void *mem;
+
+  for(;;){
+    if((mem = zero ? kalloc_zeroed() : kalloc()) != 0)
+      return mem;
+    if(swapout() == 0)
+      return 0;
+  }
+}
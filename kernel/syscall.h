@@ -21,3 +21,18 @@
 #define SYS_mkdir  20
 #define SYS_close  21
 #define SYS_ioctl  22
+#define SYS_mmap   23
+#define SYS_munmap 24
+#define SYS_madvise 25
+#define SYS_shmget 26
+#define SYS_shmat  27
+#define SYS_shmdt  28
+#define SYS_nice   29
+#define SYS_usleep 30
+#define SYS_sched_setaffinity 31
+#define SYS_sched_getaffinity 32
+#define SYS_clone  33
+#define SYS_join   34
+#define SYS_futex_wait 35
+#define SYS_futex_wake 36
+#define SYS_shmctl 37
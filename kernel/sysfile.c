@@ -8,6 +8,7 @@
 #include "riscv.h"
 #include "defs.h"
 #include "param.h"
+#include "memlayout.h"
 #include "stat.h"
 #include "spinlock.h"
 #include "proc.h"
@@ -16,16 +17,27 @@
 #include "file.h"
 #include "fcntl.h"
 
+// The open file table belongs to the process, and its threads
+// share it: the first thread's p->lock guards the table, and a
+// system call holds a reference to the file it is using, so that
+// another thread's close() can't free it meanwhile.
+
 // Fetch the nth word-sized system call argument as a file descriptor
-// and return both the descriptor and the corresponding struct file.
+// and return both the descriptor and the corresponding struct file,
+// with a reference to it that the caller must drop with fileclose().
 static int argfd(int n, int *pfd, struct file **pf) {
     int fd;
-    struct file *f;
+    struct file *f = 0;
+    struct proc *g = myproc()->group;
 
     argint(n, &fd);
-    if (fd < 0 || fd >= NOFILE || (f = myproc()->ofile[fd]) == 0) return -1;
+    if (fd < 0 || fd >= NOFILE) return -1;
+    acquire(&g->lock);
+    if ((f = g->ofile[fd]) != 0) filedup(f);
+    release(&g->lock);
+    if (f == 0) return -1;
     if (pfd) *pfd = fd;
-    if (pf) *pf = f;
+    *pf = f;
     return 0;
 }
 
@@ -33,67 +45,99 @@ static int argfd(int n, int *pfd, struct file **pf) {
 // Takes over file reference from caller on success.
 static int fdalloc(struct file *f) {
     int fd;
-    struct proc *p = myproc();
+    struct proc *g = myproc()->group;
 
+    acquire(&g->lock);
     for (fd = 0; fd < NOFILE; fd++) {
-        if (p->ofile[fd] == 0) {
-            p->ofile[fd] = f;
+        if (g->ofile[fd] == 0) {
+            g->ofile[fd] = f;
+            release(&g->lock);
             return fd;
         }
     }
+    release(&g->lock);
     return -1;
 }
 
+// Take file descriptor fd out of the table, if it still refers
+// to f, and another thread has not closed it first. The caller
+// gets the table's reference to f.
+// returns 0, or -1 if fd no longer refers to f.
+static int fdfree(int fd, struct file *f) {
+    struct proc *g = myproc()->group;
+    int r = -1;
+
+    acquire(&g->lock);
+    if (g->ofile[fd] == f) {
+        g->ofile[fd] = 0;
+        r = 0;
+    }
+    release(&g->lock);
+    return r;
+}
+
 uint64 sys_dup(void) {
     struct file *f;
     int fd;
 
     if (argfd(0, 0, &f) < 0) return -1;
-    if ((fd = fdalloc(f)) < 0) return -1;
-    filedup(f);
+    if ((fd = fdalloc(f)) < 0) {
+        fileclose(f);
+        return -1;
+    }
     return fd;
 }
 
 uint64 sys_read(void) {
     struct file *f;
-    int n;
+    int n, r;
     uint64 p;
 
     argaddr(1, &p);
     argint(2, &n);
     if (argfd(0, 0, &f) < 0) return -1;
-    return fileread(f, p, n);
+    r = fileread(f, p, n);
+    fileclose(f);
+    return r;
 }
 
 uint64 sys_write(void) {
     struct file *f;
-    int n;
+    int n, r;
     uint64 p;
 
     argaddr(1, &p);
     argint(2, &n);
     if (argfd(0, 0, &f) < 0) return -1;
 
-    return filewrite(f, p, n);
+    r = filewrite(f, p, n);
+    fileclose(f);
+    return r;
 }
 
 uint64 sys_close(void) {
-    int fd;
+    int fd, r = -1;
     struct file *f;
 
     if (argfd(0, &fd, &f) < 0) return -1;
-    myproc()->ofile[fd] = 0;
+    if (fdfree(fd, f) == 0) {
+        fileclose(f);  // the table's reference
+        r = 0;
+    }
     fileclose(f);
-    return 0;
+    return r;
 }
 
 uint64 sys_fstat(void) {
     struct file *f;
     uint64 st;  // user pointer to struct stat
+    int r;
 
     argaddr(1, &st);
     if (argfd(0, 0, &f) < 0) return -1;
-    return filestat(f, st);
+    r = filestat(f, st);
+    fileclose(f);
+    return r;
 }
 
 // Create the path new as a link to the same inode as old.
@@ -299,8 +343,7 @@ uint64 sys_open(void) {
         return -1;
     }
 
-    if ((f = filealloc()) == 0 || (fd = fdalloc(f)) < 0) {
-        if (f) fileclose(f);
+    if ((f = filealloc()) == 0) {
         iunlockput(ip);
         end_op();
         return -1;
@@ -317,6 +360,16 @@ uint64 sys_open(void) {
     f->readable = !(omode & O_WRONLY);
     f->writable = (omode & O_WRONLY) || (omode & O_RDWR);
 
+    // another thread can use fd as soon as it is in the table,
+    // so f must be ready by then.
+    if ((fd = fdalloc(f)) < 0) {
+        f->type = FD_NONE;
+        fileclose(f);
+        iunlockput(ip);
+        end_op();
+        return -1;
+    }
+
     if ((omode & O_TRUNC) && ip->type == T_FILE) {
         itrunc(ip);
     }
@@ -360,8 +413,8 @@ uint64 sys_mknod(void) {
 
 uint64 sys_chdir(void) {
     char path[MAXPATH];
-    struct inode *ip;
-    struct proc *p = myproc();
+    struct inode *ip, *old;
+    struct proc *g = myproc()->group;
 
     begin_op();
     if (argstr(0, path, MAXPATH) < 0 || (ip = namei(path)) == 0) {
@@ -375,9 +428,13 @@ uint64 sys_chdir(void) {
         return -1;
     }
     iunlock(ip);
-    iput(p->cwd);
+    // namex() takes its reference to the cwd under g->lock too.
+    acquire(&g->lock);
+    old = g->cwd;
+    g->cwd = ip;
+    release(&g->lock);
+    iput(old);
     end_op();
-    p->cwd = ip;
     return 0;
 }
 
@@ -431,17 +488,15 @@ uint64 sys_pipe(void) {
     if (pipealloc(&rf, &wf) < 0) return -1;
     fd0 = -1;
     if ((fd0 = fdalloc(rf)) < 0 || (fd1 = fdalloc(wf)) < 0) {
-        if (fd0 >= 0) p->ofile[fd0] = 0;
-        fileclose(rf);
+        // another thread may have closed fd0 already.
+        if (fd0 < 0 || fdfree(fd0, rf) == 0) fileclose(rf);
         fileclose(wf);
         return -1;
     }
     if (copyout(p->pagetable, fdarray, (char *)&fd0, sizeof(fd0)) < 0 ||
         copyout(p->pagetable, fdarray + sizeof(fd0), (char *)&fd1, sizeof(fd1)) < 0) {
-        p->ofile[fd0] = 0;
-        p->ofile[fd1] = 0;
-        fileclose(rf);
-        fileclose(wf);
+        if (fdfree(fd0, rf) == 0) fileclose(rf);
+        if (fdfree(fd1, wf) == 0) fileclose(wf);
         return -1;
     }
     return 0;
@@ -451,8 +506,86 @@ uint64 sys_ioctl(void){    //input/outout control
     struct file *file_ptr;
     int request;
     uint64 uaddr;
+    int r;
     if(argfd(0, 0, &file_ptr)<0)  return -1;
     argint(1, &request);
     argaddr(2, &uaddr);
-    return fileioctl(file_ptr, request, uaddr);
+    r = fileioctl(file_ptr, request, uaddr);
+    fileclose(file_ptr);
+    return r;
+}
+
+// Map len bytes of the file open as fd, starting at offset off,
+// or of zero-filled memory if flags has MAP_ANONYMOUS, at an
+// address of the kernel's choosing. addr is ignored. Pages are
+// filled in by vmfault() when first touched.
+uint64 sys_mmap(void) {
+    uint64 addr, len;
+    int prot, flags, off, i;
+    struct file *f = 0;
+    struct proc *p = myproc(), *g = p->group;
+    struct vma *v = 0;
+
+    argaddr(0, &addr);
+    argaddr(1, &len);
+    argint(2, &prot);
+    argint(3, &flags);
+    argint(5, &off);
+    if ((flags & MAP_ANONYMOUS) == 0 && argfd(4, 0, &f) < 0) return -1;
+    addr = -1;
+    if (len == 0 || len > MMAPTOP || off < 0 || off % PGSIZE != 0) goto out;
+    if (((flags & MAP_SHARED) != 0) == ((flags & MAP_PRIVATE) != 0)) goto out;
+    if (f) {
+        if (f->type != FD_INODE) goto out;
+        if (!f->readable) goto out;
+        if ((flags & MAP_SHARED) && (prot & PROT_WRITE) && !f->writable) goto out;
+    }
+
+    vmlock(p);
+    for (i = 0; i < NVMA; i++) {
+        if (g->vma[i].flags == 0) {
+            v = &g->vma[i];
+            break;
+        }
+    }
+    if (v == 0 || (addr = mmapalloc(g, PGROUNDUP(len))) == 0) {
+        addr = -1;
+    } else {
+        v->start = addr;
+        v->end = addr + PGROUNDUP(len);
+        v->perm = ((prot & PROT_WRITE) ? PTE_W : 0) | ((prot & PROT_EXEC) ? PTE_X : 0);
+        v->flags = flags & (MAP_SHARED | MAP_PRIVATE | MAP_ANONYMOUS);
+        v->off = off;
+        v->filesz = f ? len : 0;
+        v->ip = f ? idup(f->ip) : 0;
+    }
+    vmunlock(p);
+out:
+    if (f) fileclose(f);
+    return addr;
+}
+
+// Unmap [addr, addr+len), which must lie within one mapping
+// and include its first or last page, writing back modified
+// pages of a MAP_SHARED file mapping.
+uint64 sys_munmap(void) {
+    uint64 addr, len, end;
+    struct proc *p = myproc(), *g = p->group;
+    struct vma *v;
+    int r = -1;
+
+    argaddr(0, &addr);
+    argaddr(1, &len);
+    if (addr % PGSIZE != 0 || len == 0 || addr + len < addr) return -1;
+    vmlock(p);
+    if ((v = vmalookup(g, addr)) != 0 && v->start >= g->sz) {
+        end = PGROUNDUP(addr + len);
+        if (end > v->end) end = v->end;
+        if (addr == v->start || end == v->end) {
+            vmaunmap(g->pagetable, v, addr, end);
+            r = 0;
+        }
+    }
+    vmunlock(p);
+    return r;
 }
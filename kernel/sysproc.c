@@ -14,6 +14,7 @@
 #include "spinlock.h"
 #include "proc.h"
 #include "vm.h"
+#include "fcntl.h"
 
 uint64 sys_exit(void) {
     int n;
@@ -22,7 +23,7 @@ uint64 sys_exit(void) {
     return 0;  // not reached
 }
 
-uint64 sys_getpid(void) { return myproc()->pid; }
+uint64 sys_getpid(void) { return myproc()->group->pid; }
 
 uint64 sys_fork(void) { return kfork(); }
 
@@ -36,42 +37,162 @@ uint64 sys_sbrk(void) {
     uint64 addr;
     int t;
     int n;
+    struct proc *p = myproc(), *g = p->group;
 
     argint(0, &n);
     argint(1, &t);
-    addr = myproc()->sz;
+    vmlock(p);
+    addr = g->sz;
 
     if (t == SBRK_EAGER || n < 0) {
-        if (growproc(n) < 0) {
-            return -1;
-        }
+        if (growproc(n) < 0) addr = -1;
     } else {
         // Lazily allocate memory for this process: increase its memory
         // size but don't allocate memory. If the processes uses the
         // memory, vmfault() will allocate it.
-        if (addr + n < addr) return -1;
-        myproc()->sz += n;
+        if (addr + n < addr || addr + n > mmapbase(g)) addr = -1;
+        else g->sz += n;
     }
+    vmunlock(p);
     return addr;
 }
 
+uint64 sys_madvise(void) {
+    uint64 addr, len;
+    int advice;
+
+    struct proc *p = myproc();
+    int r;
+
+    argaddr(0, &addr);
+    argaddr(1, &len);
+    argint(2, &advice);
+    vmlock(p);
+    r = uvmadvise(p->group, addr, len, advice);
+    vmunlock(p);
+    return r;
+}
+
+uint64 sys_shmget(void) {
+    int key;
+    uint64 size;
+
+    argint(0, &key);
+    argaddr(1, &size);
+    return shmget(key, size);
+}
+
+uint64 sys_shmctl(void) {
+    int id, cmd;
+
+    argint(0, &id);
+    argint(1, &cmd);
+    if (cmd != IPC_RMID) return -1;
+    return shmrm(id);
+}
+
+uint64 sys_shmat(void) {
+    int id;
+    uint64 addr;
+    struct proc *p = myproc();
+
+    argint(0, &id);
+    argaddr(1, &addr);
+    vmlock(p);
+    addr = shmat(p->group, id, addr);
+    vmunlock(p);
+    return addr;
+}
+
+uint64 sys_shmdt(void) {
+    uint64 addr;
+    struct proc *p = myproc();
+    int r;
+
+    argaddr(0, &addr);
+    vmlock(p);
+    r = shmdt(p->group, addr);
+    vmunlock(p);
+    return r;
+}
+
+uint64 sys_clone(void) {
+    uint64 fn, arg, sp;
+
+    argaddr(0, &fn);
+    argaddr(1, &arg);
+    argaddr(2, &sp);
+    return kclone(fn, arg, sp);
+}
+
+uint64 sys_join(void) {
+    int tid;
+    uint64 addr;
+
+    argint(0, &tid);
+    argaddr(1, &addr);
+    return kjoin(tid, addr);
+}
+
+uint64 sys_futex_wait(void) {
+    uint64 addr;
+    int val;
+
+    argaddr(0, &addr);
+    argint(1, &val);
+    return futexwait(addr, val);
+}
+
+uint64 sys_futex_wake(void) {
+    uint64 addr;
+    int n;
+
+    argaddr(0, &addr);
+    argint(1, &n);
+    return futexwake(addr, n);
+}
+
+uint64 sys_nice(void) {
+    int inc;
+
+    argint(0, &inc);
+    return knice(inc);
+}
+
+uint64 sys_sched_setaffinity(void) {
+    int pid;
+    uint64 mask;
+
+    argint(0, &pid);
+    argaddr(1, &mask);
+    return ksetaffinity(pid, mask);
+}
+
+uint64 sys_sched_getaffinity(void) {
+    int pid;
+    uint64 addr, mask;
+
+    argint(0, &pid);
+    argaddr(1, &addr);
+    if ((mask = kgetaffinity(pid)) == 0) return -1;
+    if (copyout(myproc()->pagetable, addr, (char *)&mask, sizeof(mask)) < 0) return -1;
+    return 0;
+}
+
 uint64 sys_pause(void) {
     int n;
-    uint ticks0;
 
     argint(0, &n);  // Argument Retrieval: Get the sleep duration 'n' form the user stack.
     if (n < 0) n = 0;
-    acquire(&tickslock);  // Acquire Lock :Protect the global 'ticks' variables
-    ticks0 = ticks;
-    while (ticks - ticks0 < n) {
-        if (killed(myproc())) {
-            release(&tickslock);
-            return -1;
-        }
-        sleep(&ticks, &tickslock);
-    }
-    release(&tickslock);
-    return 0;
+    return timersleep(r_time() + (uint64)n * tickcycles);
+}
+
+uint64 sys_usleep(void) {
+    uint64 usec;
+
+    argaddr(0, &usec);
+    if (usec > 1000000L * 60 * 60 * 24 * 365) return -1;
+    return timersleep(r_time() + usec * (TIMEBASE / 1000000));
 }
 
 uint64 sys_kill(void) {
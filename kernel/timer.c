@@ -0,0 +1,185 @@
+// Timers for pause() and usleep().
+//
+// A sleeping process's deadline sits on a hierarchical timer
+// wheel, in units of TIMERRES cycles of the time CSR. Level 0 has
+// a slot for each of the next WHEELSLOTS units; each higher level
+// has a slot for each span of WHEELSLOTS slots of the level below,
+// whose timers move down a level (cascade) when the wheel reaches
+// that span. Adding and expiring a timer take constant time, and
+// a clock interrupt only looks at the slots it has passed, waking
+// just the processes whose deadlines have come.
+//
+// Each CPU's clock interrupt runs the wheel, and asks for its next
+// interrupt at the next tick or the next deadline, whichever is
+// sooner, so that deadlines between ticks are met on time.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+
+#define TIMERRES   (TIMEBASE / 1000)  // cycles per unit: a millisecond
+#define WHEELBITS  8
+#define WHEELSLOTS (1 << WHEELBITS)
+#define WHEELMASK  (WHEELSLOTS - 1)
+#define NLEVEL     4                  // 2^32 units: over 49 days
+
+struct {
+  struct spinlock lock;
+  uint64 now;                          // next unit to expire
+  int n;                               // timers on the wheel
+  int nhigh;                           // timers above level 0
+  struct proc *wheel[NLEVEL][WHEELSLOTS];
+} timer;
+
+void
+timerwheelinit(void)
+{
+  initlock(&timer.lock, "timer");
+}
+
+// Put p on the wheel, in the slot for unit p->tmdue.
+static void
+timeradd(struct proc *p)
+{
+  uint64 due = p->tmdue, delta;
+  struct proc **slot;
+  int l;
+
+  if(due < timer.now)
+    due = timer.now;
+  delta = due - timer.now;
+  for(l = 0; l < NLEVEL - 1 && delta >= (1L << (WHEELBITS*(l+1))); l++)
+    ;
+  // a deadline beyond the wheel waits at its far edge,
+  // and timerintr() puts it back on from there.
+  if(delta >= (1L << (WHEELBITS*NLEVEL)))
+    due = timer.now + (1L << (WHEELBITS*NLEVEL)) - 1;
+  slot = &timer.wheel[l][(due >> (WHEELBITS*l)) & WHEELMASK];
+
+  p->tmlevel = l;
+  p->tmnext = *slot;
+  if(*slot)
+    (*slot)->tmpprev = &p->tmnext;
+  p->tmpprev = slot;
+  *slot = p;
+  timer.n++;
+  if(l > 0)
+    timer.nhigh++;
+}
+
+// Take p off the wheel.
+static void
+timerdel(struct proc *p)
+{
+  *p->tmpprev = p->tmnext;
+  if(p->tmnext)
+    p->tmnext->tmpprev = p->tmpprev;
+  timer.n--;
+  if(p->tmlevel > 0)
+    timer.nhigh--;
+}
+
+// Move the timers in level l's slot for the current unit down.
+static void
+cascade(int l)
+{
+  struct proc **slot = &timer.wheel[l][(timer.now >> (WHEELBITS*l)) & WHEELMASK];
+  struct proc *p;
+
+  while((p = *slot) != 0){
+    timerdel(p);
+    timeradd(p);
+  }
+}
+
+// Called from clockintr() at time now (in cycles): wake the
+// processes whose deadlines have passed. Returns when the
+// next clock interrupt should come: at nexttick, or sooner
+// if there is a deadline before then.
+uint64
+timerintr(uint64 now, uint64 nexttick)
+{
+  struct proc *p, **slot;
+  uint64 u, next;
+  int l;
+
+  acquire(&timer.lock);
+  if(timer.n == 0)
+    timer.now = now / TIMERRES + 1;
+  while(timer.now <= now / TIMERRES){
+    if((timer.now & WHEELMASK) == 0 && timer.nhigh > 0){
+      for(l = 1; l < NLEVEL; l++){
+        cascade(l);
+        if(((timer.now >> (WHEELBITS*l)) & WHEELMASK) != 0)
+          break;
+      }
+    }
+    slot = &timer.wheel[0][timer.now & WHEELMASK];
+    while((p = *slot) != 0){
+      timerdel(p);
+      if(p->tmdue > timer.now){
+        // timeradd() put it at the far edge of the wheel.
+        timeradd(p);
+        continue;
+      }
+      p->tmdue = 0;
+      wakeup(&p->tmdue);
+    }
+    timer.now++;
+  }
+
+  // the next deadline, if it is before the next tick, or
+  // the next cascade, which may bring one down to level 0.
+  next = nexttick;
+  for(u = timer.now; timer.n > 0 && u * TIMERRES < next && u < timer.now + WHEELSLOTS; u++){
+    if(timer.wheel[0][u & WHEELMASK]){
+      next = u * TIMERRES;
+      break;
+    }
+  }
+  u = (timer.now + WHEELMASK) & ~(uint64)WHEELMASK;
+  if(timer.nhigh > 0 && u * TIMERRES < next)
+    next = u * TIMERRES;
+  release(&timer.lock);
+  return next;
+}
+
+// Sleep until the time CSR reaches deadline.
+// returns 0, or -1 if killed.
+int
+timersleep(uint64 deadline)
+{
+  struct proc *p = myproc();
+  uint64 due;
+
+  if(deadline <= r_time())
+    return 0;
+
+  // the unit at or after the deadline, so as never to wake early.
+  due = (deadline + TIMERRES - 1) / TIMERRES;
+
+  acquire(&timer.lock);
+  p->tmdue = due;
+  timeradd(p);
+  // have this CPU's clock interrupt come in time for it.
+  if(due * TIMERRES < r_stimecmp())
+    w_stimecmp(due * TIMERRES);
+
+  while(p->tmdue != 0){
+    if(killed(p)){
+      timerdel(p);
+      p->tmdue = 0;
+      release(&timer.lock);
+      return -1;
+    }
+    p->swapok = 1;  // nothing here uses our pages
+    sleep(&p->tmdue, &timer.lock);
+    p->swapok = 0;
+  }
+  release(&timer.lock);
+  return 0;
+}
@@ -8,6 +8,8 @@
 
 struct spinlock tickslock;
 uint ticks;
+uint64 tickcycles = TICKCYCLES;  // time-CSR cycles per tick, from the hz= boot argument
+static uint64 tickstart;         // time of tick 0
 
 extern char trampoline[], uservec[];
 
@@ -16,7 +18,21 @@ void kernelvec();
 
 extern int devintr();
 
-void trapinit(void) { initlock(&tickslock, "time"); }
+void trapinit(void) {
+    char arg[8];
+    int hz = 0;
+
+    initlock(&tickslock, "time");
+
+    // the tick rate, which sets the scheduling quantum.
+    if (bootarg("hz", arg, sizeof(arg)) >= 0) {
+        for (char *s = arg; *s >= '0' && *s <= '9'; s++) hz = hz * 10 + *s - '0';
+        if (hz >= 1 && hz <= 10000) tickcycles = TIMEBASE / hz;
+        else
+            printf("bad hz=%s; using %d\n", arg, TIMEBASE / TICKCYCLES);
+    }
+    tickstart = r_time();
+}
 
 // set up to take exceptions and traps while in the kernel.
 void trapinithart(void) { w_stvec((uint64)kernelvec); }
@@ -35,6 +51,12 @@ uint64 usertrap(void) {
     // since we're now in the kernel.
     w_stvec((uint64)kernelvec);
 
+    // this CPU has stopped using the process's TLB entries,
+    // as asidsync() waits to see.
+    struct cpu *c = mycpu();
+    __atomic_store_n(&c->user, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&c->usertraps, c->usertraps + 1, __ATOMIC_RELEASE);
+
     struct proc *p = myproc();
 
     // save user program counter.
@@ -56,9 +78,9 @@ uint64 usertrap(void) {
         syscall();
     } else if ((which_dev = devintr()) != 0) {
         // ok
-    } else if ((r_scause() == 15 || r_scause() == 13) &&
-               vmfault(p->pagetable, r_stval(), (r_scause() == 13) ? 1 : 0) != 0) {
-        // page fault on lazily-allocated page
+    } else if ((r_scause() == 15 || r_scause() == 13 || r_scause() == 12) &&
+               vmfault(p->pagetable, r_stval(), (r_scause() == 15) ? 0 : 1) != 0) {
+        // page fault on lazily-allocated, not yet loaded, or copy-on-write page
     } else {
         printf("usertrap(): unexpected scause 0x%lx pid=%d\n", r_scause(), p->pid);
         printf("            sepc=0x%lx stval=0x%lx\n", r_sepc(), r_stval());
@@ -67,13 +89,19 @@ uint64 usertrap(void) {
 
     if (killed(p)) kexit(-1);
 
-    // give up the CPU if this is a timer interrupt.
-    if (which_dev == 2) yield();
+    // give up the CPU if this is a timer interrupt and the
+    // scheduler says the process has had its turn. the process
+    // is stopped in user space, so its pages may be paged out.
+    if (which_dev == 2 && schedtick()) {
+        p->swapok = 1;
+        yield();
+        p->swapok = 0;
+    }
 
     prepare_return();
 
     // the user page table to switch to, for trampoline.S
-    uint64 satp = MAKE_SATP(p->pagetable);
+    uint64 satp = asidsatp(p);
 
     // return to trampoline.S; satp value in a0.
     return satp;
@@ -101,6 +129,13 @@ void prepare_return(void) {
     p->trapframe->kernel_trap = (uint64)usertrap;
     p->trapframe->kernel_hartid = r_tp();  // hartid for cpuid()
 
+    // keep the usyscall page's clock current. ticks only
+    // moves on timer interrupts, which come through here.
+    p->group->usyscall->ticks = ticks;
+
+    // where uservec and userret find this thread's trapframe.
+    w_sscratch(p->trapframeva);
+
     // set up the registers that trampoline.S's sret will use
     // to get to user space.
 
@@ -140,18 +175,31 @@ void kerneltrap() {
     w_sstatus(sstatus);
 }
 
-void clockintr() {
-    if (cpuid() == 0) {
+// a timer interrupt: a clock tick, or an earlier pause()
+// or usleep() deadline. returns 1 if it was a tick.
+int clockintr() {
+    struct cpu *c = mycpu();
+    uint64 now = r_time();
+    int tick = 0;
+
+    if (now >= c->nexttick) {
+        // idle CPUs skip ticks (see idle() in proc.c), so any
+        // CPU's tick brings ticks up to date with the time.
         acquire(&tickslock);
-        ticks++;
-        wakeup(&ticks);
+        if (now - tickstart >= (ticks + 1) * tickcycles) {
+            ticks = (now - tickstart) / tickcycles;
+            wakeup(&ticks);
+        }
         release(&tickslock);
+        c->nexttick = now + tickcycles;
+        tick = 1;
     }
 
-    // ask for the next timer interrupt. this also clears
-    // the interrupt request. 1000000 is about a tenth
-    // of a second.
-    w_stimecmp(r_time() + 1000000);
+    // wake processes whose deadlines have passed, and ask for
+    // the next timer interrupt. this also clears the interrupt
+    // request.
+    w_stimecmp(timerintr(now, c->nexttick));
+    return tick;
 }
 
 // check if it's an external interrupt or software interrupt,
@@ -183,9 +231,14 @@ int devintr() {
 
         return 1;
     } else if (scause == 0x8000000000000005L) {
-        // timer interrupt.
-        clockintr();
-        return 2;
+        // timer interrupt; only a tick preempts.
+        return clockintr() ? 2 : 1;
+    } else if (scause == 0x8000000000000001L) {
+        // software interrupt from mswvec: another CPU woke this
+        // one from idle() to run a process it queued here, or
+        // made it trap from user mode for asidsync().
+        w_sip(r_sip() & ~SIP_SSIP);
+        return 1;
     } else {
         return 0;
     }
@@ -7,6 +7,31 @@
 #include "spinlock.h"
 #include "proc.h"
 #include "fs.h"
+#include "sleeplock.h"
+#include "file.h"
+#include "fcntl.h"
+#include "vm.h"
+
+// pages that vmfault() reads from a file per fault: the
+// faulting page and the ones after it in the same region.
+#define FAULTAROUND 4
+
+// most pages that vmfault() maps ahead of a sequential scan.
+#define FAULTAHEAD 16
+
+// most pages that uvmevict() looks at per call.
+#define SWAPSCAN 1024
+
+// flushing more pages than this at once flushes the whole ASID.
+#define TLBFLUSHMAX 32
+
+// most pages uvmunmap() unmaps before freeing them.
+#define UNMAPBATCH 32
+
+static int copyrange(pagetable_t, pagetable_t, uint64, uint64, int);
+static pte_t *walklevel(pagetable_t, uint64, int, int);
+static void tlbflush(pagetable_t, uint64, uint64);
+static void tlbsync(pagetable_t);
 
 /*
  * the kernel's page table.
@@ -23,8 +48,7 @@ kvmmake(void)
 {
   pagetable_t kpgtbl;
 
-  kpgtbl = (pagetable_t) kalloc();
-  memset(kpgtbl, 0, PGSIZE);
+  kpgtbl = (pagetable_t) kalloc_zeroed();
 
   // uart registers
   kvmmap(kpgtbl, UART0, UART0, PGSIZE, PTE_R | PTE_W);
@@ -35,6 +59,9 @@ kvmmake(void)
   // PLIC
   kvmmap(kpgtbl, PLIC, PLIC, 0x4000000, PTE_R | PTE_W);
 
+  // CLINT msip registers, for waking idle CPUs.
+  kvmmap(kpgtbl, CLINT, CLINT, PGSIZE, PTE_R | PTE_W);
+
   // map kernel text executable and read-only.
   kvmmap(kpgtbl, KERNBASE, KERNBASE, (uint64)etext-KERNBASE, PTE_R | PTE_X);
 
@@ -82,9 +109,30 @@ kvminithart()
   sfence_vma();
 }
 
+// Split the superpage mapped by level-1 PTE *pte into 512
+// level-0 PTEs with the same permissions, in page-table page
+// pt, or in a new one if pt is 0. *pte may have had PTE_V
+// cleared while pt was made ready.
+// returns 0 on success, -1 if out of memory.
+static int
+demote(pte_t *pte, pagetable_t pt)
+{
+  uint64 pa = PTE2PA(*pte);
+  int flags = PTE_FLAGS(*pte) | PTE_V;
+
+  if(pt == 0 && (pt = (pagetable_t)kalloc()) == 0)
+    return -1;
+  for(int i = 0; i < 512; i++)
+    pt[i] = PA2PTE(pa + i*PGSIZE) | flags;
+  *pte = PA2PTE(pt) | PTE_V;
+  return 0;
+}
+
 // Return the address of the PTE in page table pagetable
 // that corresponds to virtual address va.  If alloc!=0,
-// create any required page-table pages.
+// create any required page-table pages. A superpage on the
+// way is split into 4096-byte pages, even if alloc is 0;
+// returns 0 if that needs memory and there is none.
 //
 // The risc-v Sv39 scheme has three levels of page-table
 // pages. A page-table page contains 512 64-bit PTEs.
@@ -96,24 +144,91 @@ kvminithart()
 //    0..11 -- 12 bits of byte offset within the page.
 pte_t *
 walk(pagetable_t pagetable, uint64 va, int alloc)
+{
+  return walklevel(pagetable, va, alloc, 0);
+}
+
+// Like walk(), but return the level-1 PTE if level is 1.
+static pte_t *
+walklevel(pagetable_t pagetable, uint64 va, int alloc, int level)
 {
   if(va >= MAXVA)
     panic("walk");
 
-  for(int level = 2; level > 0; level--) {
-    pte_t *pte = &pagetable[PX(level, va)];
+  for(int l = 2; l > level; l--) {
+    pte_t *pte = &pagetable[PX(l, va)];
     if(*pte & PTE_V) {
+      if(PTE_LEAF(*pte) && demote(pte, 0) < 0)
+        return 0;
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
-      if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
+      if(!alloc || (pagetable = (pde_t*)kalloc_zeroed()) == 0)
         return 0;
-      memset(pagetable, 0, PGSIZE);
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
+  return &pagetable[PX(level, va)];
+}
+
+// Return the leaf PTE that maps va, without splitting
+// superpages, and set *level to 1 if it maps a superpage
+// or to 0 if it maps a page. returns 0 if there is no
+// page-table page for va.
+static pte_t *
+leafpte(pagetable_t pagetable, uint64 va, int *level)
+{
+  pte_t *pte;
+
+  if(va >= MAXVA)
+    panic("leafpte");
+
+  pte = &pagetable[PX(2, va)];
+  if((*pte & PTE_V) == 0)
+    return 0;
+  pagetable = (pagetable_t)PTE2PA(*pte);
+  pte = &pagetable[PX(1, va)];
+  if((*pte & PTE_V) == 0)
+    return 0;
+  if(PTE_LEAF(*pte)){
+    *level = 1;
+    return pte;
+  }
+  pagetable = (pagetable_t)PTE2PA(*pte);
+  *level = 0;
   return &pagetable[PX(0, va)];
 }
 
+// Flush TLB entries for npages pages at va after their PTEs in
+// pagetable changed. Only a process changes its own page table;
+// any other is being built or freed, and nothing runs on it.
+static void
+tlbflush(pagetable_t pagetable, uint64 va, uint64 npages)
+{
+  struct proc *p = myproc();
+
+  if(p == 0 || p->pagetable != pagetable)
+    return;
+  if(npages > TLBFLUSHMAX){
+    asidflush(p, -1);
+    return;
+  }
+  for(; npages > 0; npages--, va += PGSIZE)
+    asidflush(p, va);
+}
+
+// After tlbflush(), wait until the process's other threads can
+// no longer be using the flushed entries on other CPUs, before
+// the pages they mapped are freed or their old contents go
+// stale. Costs nothing for a process with one thread.
+static void
+tlbsync(pagetable_t pagetable)
+{
+  struct proc *p = myproc();
+
+  if(p && p->pagetable == pagetable)
+    asidsync(p);
+}
+
 // Look up a virtual address, return the physical address,
 // or 0 if not mapped.
 // Can only be used to look up user pages.
@@ -122,11 +237,12 @@ walkaddr(pagetable_t pagetable, uint64 va)
 {
   pte_t *pte;
   uint64 pa;
+  int level;
 
   if(va >= MAXVA)
     return 0;
 
-  pte = walk(pagetable, va, 0);
+  pte = leafpte(pagetable, va, &level);
   if(pte == 0)
     return 0;
   if((*pte & PTE_V) == 0)
@@ -134,11 +250,14 @@ walkaddr(pagetable_t pagetable, uint64 va)
   if((*pte & PTE_U) == 0)
     return 0;
   pa = PTE2PA(*pte);
+  if(level == 1)
+    pa += PGROUNDDOWN(va) - SUPERPGROUNDDOWN(va);
   return pa;
 }
 
 // Create PTEs for virtual addresses starting at va that refer to
-// physical addresses starting at pa.
+// physical addresses starting at pa, using superpages where
+// va and pa are suitably aligned and nothing is mapped yet.
 // va and size MUST be page-aligned.
 // Returns 0 on success, -1 if walk() couldn't
 // allocate a needed page-table page.
@@ -160,9 +279,18 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
   a = va;
   last = va + size - PGSIZE;
   for(;;){
+    if(a % SUPERPGSIZE == 0 && pa % SUPERPGSIZE == 0 && last - a >= SUPERPGSIZE - PGSIZE &&
+       (pte = walklevel(pagetable, a, 1, 1)) != 0 && *pte == 0){
+      *pte = PA2PTE(pa) | perm | PTE_V;
+      if(a + SUPERPGSIZE - PGSIZE == last)
+        break;
+      a += SUPERPGSIZE;
+      pa += SUPERPGSIZE;
+      continue;
+    }
     if((pte = walk(pagetable, a, 1)) == 0)
       return -1;
-    if(*pte & PTE_V)
+    if(*pte & (PTE_V|PTE_S))
       panic("mappages: remap");
     *pte = PA2PTE(pa) | perm | PTE_V;
     if(a == last)
@@ -170,6 +298,7 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
     a += PGSIZE;
     pa += PGSIZE;
   }
+  tlbflush(pagetable, va, size / PGSIZE);
   return 0;
 }
 
@@ -179,36 +308,94 @@ pagetable_t
 uvmcreate()
 {
   pagetable_t pagetable;
-  pagetable = (pagetable_t) kalloc();
+  pagetable = (pagetable_t) kalloc_zeroed();
   if(pagetable == 0)
     return 0;
-  memset(pagetable, 0, PGSIZE);
   return pagetable;
 }
 
+// Free the n pages that uvmunmap() took out of [va, end),
+// once no TLB can reach them. An entry with bit 0 set is a
+// whole superpage.
+static void
+unmapfree(pagetable_t pagetable, uint64 va, uint64 end, uint64 *pa, int n)
+{
+  tlbflush(pagetable, va, (end - va) / PGSIZE);
+  if(n == 0)
+    return;
+  tlbsync(pagetable);
+  for(int i = 0; i < n; i++){
+    if(pa[i] & 1){
+      for(int j = 0; j < 512; j++)
+        kfree((void*)((pa[i] & ~1L) + j*PGSIZE));
+    } else {
+      kfree((void*)pa[i]);
+    }
+  }
+}
+
 // Remove npages of mappings starting from va. va must be
 // page-aligned. It's OK if the mappings don't exist.
-// Optionally free the physical memory.
+// Optionally free the physical memory, UNMAPBATCH pages
+// at a time once their mappings are gone.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 {
-  uint64 a;
+  uint64 a, pa, start, freed[UNMAPBATCH];
   pte_t *pte;
+  int level, n = 0;
 
   if((va % PGSIZE) != 0)
     panic("uvmunmap: not aligned");
 
+  start = va;
   for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
-    if((pte = walk(pagetable, a, 0)) == 0) // leaf page table entry allocated?
+    if(n == UNMAPBATCH){
+      unmapfree(pagetable, start, a, freed, n);
+      start = a;
+      n = 0;
+    }
+    if((pte = leafpte(pagetable, a, &level)) == 0) // leaf page table entry allocated?
       continue;   
+    if(*pte & PTE_S){  // paged out?
+      swapfree(PTE2SLOT(*pte));
+      *pte = 0;
+      continue;
+    }
     if((*pte & PTE_V) == 0)  // has physical page been allocated?
       continue;
-    if(do_free){
-      uint64 pa = PTE2PA(*pte);
-      kfree((void*)pa);
+    pa = PTE2PA(*pte);
+    if(level == 1 && a % SUPERPGSIZE == 0 && a + SUPERPGSIZE <= va + npages*PGSIZE){
+      // the whole superpage goes.
+      if(do_free)
+        freed[n++] = pa | 1;
+      *pte = 0;
+      a += SUPERPGSIZE - PGSIZE;
+      continue;
+    }
+    if(level == 1){
+      // only part of a superpage goes, so split it.
+      pa += PGROUNDDOWN(a) - SUPERPGROUNDDOWN(a);
+      if(demote(pte, 0) < 0){
+        // no memory for the new page table: if the page at a is
+        // being freed, it can hold it, once no TLB still maps
+        // the page through the superpage.
+        if(!do_free)
+          panic("uvmunmap: demote");
+        *pte &= ~PTE_V;
+        tlbflush(pagetable, SUPERPGROUNDDOWN(a), SUPERPGSIZE / PGSIZE);
+        tlbsync(pagetable);
+        demote(pte, (pagetable_t)pa);
+        *walk(pagetable, a, 0) = 0;
+        continue;
+      }
+      pte = walk(pagetable, a, 0);
     }
+    if(do_free)
+      freed[n++] = pa;
     *pte = 0;
   }
+  unmapfree(pagetable, start, va + npages*PGSIZE, freed, n);
 }
 
 // Allocate PTEs and physical memory to grow a process from oldsz to
@@ -224,12 +411,25 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
 
   oldsz = PGROUNDUP(oldsz);
   for(a = oldsz; a < newsz; a += PGSIZE){
-    mem = kalloc();
+    // map whole aligned 2-megabyte chunks with superpages, to
+    // save page-table pages and TLB entries.
+    if(a % SUPERPGSIZE == 0 && newsz - a >= SUPERPGSIZE &&
+       (mem = kalloc_pages(SUPERPGORDER)) != 0){
+      memset(mem, 0, SUPERPGSIZE);
+      if(mappages(pagetable, a, SUPERPGSIZE, (uint64)mem, PTE_R|PTE_U|xperm) != 0){
+        uvmunmap(pagetable, a, SUPERPGSIZE / PGSIZE, 0);
+        kfree_pages(mem, SUPERPGORDER);
+        uvmdealloc(pagetable, a, oldsz);
+        return 0;
+      }
+      a += SUPERPGSIZE - PGSIZE;
+      continue;
+    }
+    mem = kalloc_user(1);
     if(mem == 0){
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
     if(mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_R|PTE_U|xperm) != 0){
       kfree(mem);
       uvmdealloc(pagetable, a, oldsz);
@@ -289,37 +489,66 @@ uvmfree(pagetable_t pagetable, uint64 sz)
 
 // Given a parent process's page table, copy
 // its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Copies the page table but not the physical
+// memory: writable pages are shared copy-on-write,
+// read-only in both page tables, and copied by
+// uvmcow() when either process writes to them.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
 uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
 {
-  pte_t *pte;
+  return copyrange(old, new, 0, sz, 0);
+}
+
+// Map the pages of old in [start, end) into new, sharing
+// writable pages copy-on-write, or, if share is set, sharing
+// them writable as they are (for MAP_SHARED regions).
+// returns 0 on success, -1 on failure, leaving nothing
+// mapped in new on failure.
+static int
+copyrange(pagetable_t old, pagetable_t new, uint64 start, uint64 end, int share)
+{
+  pte_t *pte, *npte;
   uint64 pa, i;
   uint flags;
-  char *mem;
+  int level;
 
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walk(old, i, 0)) == 0)
+  for(i = start; i < end; i += PGSIZE){
+    if((pte = leafpte(old, i, &level)) == 0)
       continue;   // page table entry hasn't been allocated
+    if(*pte & PTE_S){
+      // paged out: share the swap slot.
+      if(!share && (*pte & PTE_W))
+        *pte = (*pte & ~PTE_W) | PTE_COW;
+      if((npte = walk(new, i, 1)) == 0)
+        goto err;
+      *npte = *pte;
+      swapdup(PTE2SLOT(*pte));
+      continue;
+    }
     if((*pte & PTE_V) == 0)
       continue;   // physical page hasn't been allocated
+    if(level == 1){
+      // copy-on-write works on 4096-byte pages.
+      if(demote(pte, 0) < 0)
+        goto err;
+      pte = walk(old, i, 0);
+    }
+    if(!share && (*pte & PTE_W)){
+      *pte = (*pte & ~PTE_W) | PTE_COW;
+      tlbflush(old, i, 1);
+    }
     pa = PTE2PA(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
+    if(mappages(new, i, PGSIZE, pa, flags) != 0)
       goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem);
-      goto err;
-    }
+    krefinc((void*)pa);
   }
   return 0;
 
  err:
-  uvmunmap(new, 0, i / PGSIZE, 1);
+  uvmunmap(new, start, (i - start) / PGSIZE, 1);
   return -1;
 }
 
@@ -336,42 +565,85 @@ uvmclear(pagetable_t pagetable, uint64 va)
   *pte &= ~PTE_U;
 }
 
+// Find the physical address of user address va for copyout()
+// or a futex (write set) or copyin(), faulting the page in, or copying it
+// if it is copy-on-write, as a user access would. Sets *n to the
+// bytes from va to the end of the page or superpage that maps
+// it, which are contiguous in physical memory, so that a copy
+// needs one walk per page rather than one per byte.
+// returns 0 if user code could not make the access.
+uint64
+userpa(pagetable_t pagetable, uint64 va, int write, uint64 *n)
+{
+  pte_t *pte;
+  uint64 size;
+  int level, tries;
+
+  // a fault may sleep on the disk, so a caller holding a
+  // spinlock would panic in sched(), but only on the rare
+  // call that finds the page missing. say so every time.
+  if(!intr_get())
+    panic("userpa: spinlock held");
+  if(va >= MAXVA)
+    return 0;
+  for(tries = 0; ; tries++){
+    pte = leafpte(pagetable, va, &level);
+    if(pte && (*pte & (PTE_V|PTE_U)) == (PTE_V|PTE_U) && (!write || (*pte & PTE_W)))
+      break;
+    // a paged-out copy-on-write page takes two faults.
+    if(tries == 2 || vmfault(pagetable, va, !write) == 0)
+      return 0;
+  }
+  size = level == 1 ? SUPERPGSIZE : PGSIZE;
+  *n = size - (va & (size - 1));
+  return PTE2PA(*pte) + (va & (size - 1));
+}
+
+// Take the current process's vmlock if pagetable is its own,
+// so that another thread can't unmap the pages a copy is using.
+// Caller must hold no spinlocks.
+// returns 1 if it took the lock, for uvmunlock().
+static int
+uvmlock(pagetable_t pagetable)
+{
+  struct proc *p = myproc();
+
+  if(p == 0 || p->pagetable != pagetable)
+    return 0;
+  return vmlock(p);
+}
+
+static void
+uvmunlock(int locked)
+{
+  if(locked)
+    vmunlock(myproc());
+}
+
 // Copy from kernel to user.
 // Copy len bytes from src to virtual address dstva in a given page table.
 // Return 0 on success, -1 on error.
 int
 copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 {
-  uint64 n, va0, pa0;
-  pte_t *pte;
+  uint64 n, pa;
+  int locked = uvmlock(pagetable), r = 0;
 
   while(len > 0){
-    va0 = PGROUNDDOWN(dstva);
-    if(va0 >= MAXVA)
-      return -1;
-  
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0) {
-      if((pa0 = vmfault(pagetable, va0, 0)) == 0) {
-        return -1;
-      }
+    if((pa = userpa(pagetable, dstva, 1, &n)) == 0){
+      r = -1;
+      break;
     }
-
-    pte = walk(pagetable, va0, 0);
-    // forbid copyout over read-only user text pages.
-    if((*pte & PTE_W) == 0)
-      return -1;
-      
-    n = PGSIZE - (dstva - va0);
     if(n > len)
       n = len;
-    memmove((void *)(pa0 + (dstva - va0)), src, n);
+    memmove((void *)pa, src, n);
 
     len -= n;
     src += n;
-    dstva = va0 + PGSIZE;
+    dstva += n;
   }
-  return 0;
+  uvmunlock(locked);
+  return r;
 }
 
 // Copy from user to kernel.
@@ -380,26 +652,24 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 int
 copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 {
-  uint64 n, va0, pa0;
+  uint64 n, pa;
+  int locked = uvmlock(pagetable), r = 0;
 
   while(len > 0){
-    va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0) {
-      if((pa0 = vmfault(pagetable, va0, 0)) == 0) {
-        return -1;
-      }
+    if((pa = userpa(pagetable, srcva, 0, &n)) == 0){
+      r = -1;
+      break;
     }
-    n = PGSIZE - (srcva - va0);
     if(n > len)
       n = len;
-    memmove(dst, (void *)(pa0 + (srcva - va0)), n);
+    memmove(dst, (void *)pa, n);
 
     len -= n;
     dst += n;
-    srcva = va0 + PGSIZE;
+    srcva += n;
   }
-  return 0;
+  uvmunlock(locked);
+  return r;
 }
 
 // Copy a null-terminated string from user to kernel.
@@ -409,77 +679,525 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 int
 copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 {
-  uint64 n, va0, pa0;
-  int got_null = 0;
+  uint64 n, pa;
+  int locked = uvmlock(pagetable), r = -1;
 
-  while(got_null == 0 && max > 0){
-    va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
-      return -1;
-    n = PGSIZE - (srcva - va0);
+  while(max > 0 && r < 0){
+    if((pa = userpa(pagetable, srcva, 0, &n)) == 0)
+      break;
     if(n > max)
       n = max;
+    srcva += n;
+    max -= n;
 
-    char *p = (char *) (pa0 + (srcva - va0));
+    char *p = (char *) pa;
     while(n > 0){
-      if(*p == '\0'){
-        *dst = '\0';
-        got_null = 1;
+      if((*dst = *p) == '\0'){
+        r = 0;
         break;
-      } else {
-        *dst = *p;
       }
       --n;
-      --max;
       p++;
       dst++;
     }
-
-    srcva = va0 + PGSIZE;
   }
-  if(got_null){
+  uvmunlock(locked);
+  return r;
+}
+
+// Give the process its own writable copy of the copy-on-write
+// page at va. If no other process still shares the page, just
+// make it writable again.
+// returns the page's new physical address, or 0 if va is not
+// a copy-on-write page or if out of physical memory.
+uint64
+uvmcow(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  uint64 pa;
+  char *mem = 0;
+
+ again:
+  if((pte = walk(pagetable, va, 0)) == 0 ||
+     (*pte & (PTE_V|PTE_U|PTE_COW)) != (PTE_V|PTE_U|PTE_COW)){
+    if(mem)
+      kfree(mem);
     return 0;
+  }
+  pa = PTE2PA(*pte);
+  if(krefcnt((void*)pa) == 1){
+    if(mem)
+      kfree(mem);
+    *pte = (*pte & ~PTE_COW) | PTE_W;
+    tlbflush(pagetable, va, 1);
+    return pa;
+  }
+  if(mem == 0){
+    // finding memory may page out some of this process's
+    // pages, so look at the PTE again afterwards.
+    if((mem = kalloc_user(0)) == 0)
+      return 0;
+    goto again;
+  }
+  memmove(mem, (char*)pa, PGSIZE);
+  *pte = PA2PTE(mem) | (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W;
+  tlbflush(pagetable, va, 1);
+  // other threads must not go on reading the old copy once
+  // this one writes to the new.
+  tlbsync(pagetable);
+  futexmoved(pa);
+  kfree((void*)pa);
+  return (uint64)mem;
+}
+
+// Fill in the page at va of region v and map it: read it from
+// the file into a new physical page, or map the shared copy from
+// the page cache if the region is a read-only file mapping.
+// Anonymous pages and pages past the file data are zero.
+// va must be page-aligned and unmapped. If swap is set, other
+// user pages may be paged out to find memory (see kalloc_user()).
+// Caller must hold v->ip->lock if v has a file.
+// returns the physical address, or 0 if out of memory or
+// the file can't be read.
+static uint64
+vmaload(pagetable_t pagetable, struct vma *v, uint64 va, int swap)
+{
+  char *mem;
+  uint64 off;
+  int n = 0;
+
+  off = va - v->start;
+  if(v->ip && off < v->filesz){
+    n = v->filesz - off < PGSIZE ? v->filesz - off : PGSIZE;
+    if((v->perm & PTE_W) == 0){
+      if((mem = (char*)pagecache_get(v->ip, v->off + off, n)) == 0)
+        return 0;
+      goto map;
+    }
+  }
+  if(n == 0){
+    if((mem = swap ? kalloc_user(1) : kalloc_zeroed()) == 0)
+      return 0;
   } else {
-    return -1;
+    if((mem = swap ? kalloc_user(0) : kalloc()) == 0)
+      return 0;
+    // a short read means the file ends inside the page.
+    if((n = readi(v->ip, 0, (uint64)mem, v->off + off, n)) < 0){
+      kfree(mem);
+      return 0;
+    }
+    memset(mem + n, 0, PGSIZE - n);
+  }
+ map:
+  if(mappages(pagetable, va, PGSIZE, (uint64)mem, v->perm|PTE_U|PTE_R) != 0){
+    kfree(mem);
+    return 0;
+  }
+  return (uint64)mem;
+}
+
+// Handle a fault at va in region v: fill in the page, and for
+// a file mapping up to FAULTAROUND-1 unmapped pages after it,
+// or as v->advice says.
+static uint64
+vmafault(pagetable_t pagetable, struct vma *v, uint64 va)
+{
+  uint64 mem, a;
+  int locked = 1, n;
+
+  if(v->advice == MADV_SEQUENTIAL)
+    n = FAULTAHEAD;
+  else if(v->advice == MADV_RANDOM || v->ip == 0)
+    n = 1;
+  else
+    n = FAULTAROUND;
+
+  // the caller may be copying to or from this very file,
+  // with its lock held (e.g. read() of the running binary).
+  // readi() and writei() copy user memory with no buf held,
+  // so reading the file's blocks here can't deadlock.
+  if(v->ip && (locked = holdingsleep(&v->ip->lock)) == 0)
+    ilock(v->ip);
+  mem = vmaload(pagetable, v, va, 1);
+  for(a = va + PGSIZE; mem && a < va + n*PGSIZE; a += PGSIZE){
+    if(a >= v->end || ismapped(pagetable, a))
+      break;
+    if(vmaload(pagetable, v, a, 0) == 0)
+      break;
+  }
+  if(!locked)
+    iunlock(v->ip);
+  return mem;
+}
+
+// Handle a fault at va in p's lazily allocated heap by mapping
+// zeroed pages. A fault just past the pages the previous fault
+// mapped looks like a sequential scan, so map twice as many
+// pages as last time, up to FAULTAHEAD; any other fault maps
+// only its own page. p->heapadvice can override the guess.
+static uint64
+heapfault(struct proc *p, pagetable_t pagetable, uint64 va)
+{
+  uint64 mem, pa, a;
+  int n;
+
+  if(p->heapadvice == MADV_SEQUENTIAL)
+    n = FAULTAHEAD;
+  else if(p->heapadvice == MADV_NORMAL && va == p->faultnext)
+    n = p->faultwin * 2 > FAULTAHEAD ? FAULTAHEAD : p->faultwin * 2;
+  else
+    n = 1;
+  if(n < 1)
+    n = 1;
+
+  mem = 0;
+  for(a = va; a < va + n*PGSIZE && a < p->sz; a += PGSIZE){
+    if(a > va && ismapped(pagetable, a))
+      break;
+    // only the faulting page is worth paging others out for.
+    if((pa = (uint64)(a == va ? kalloc_user(1) : kalloc_zeroed())) == 0)
+      break;
+    if(mappages(pagetable, a, PGSIZE, pa, PTE_W|PTE_U|PTE_R) != 0){
+      kfree((void*)pa);
+      break;
+    }
+    if(a == va)
+      mem = pa;
+  }
+  p->faultwin = (a - va) / PGSIZE;
+  p->faultnext = a;
+  return mem;
+}
+
+// Read paged-out page va back in from swap.
+// returns its physical address, or 0 if out of memory.
+static uint64
+swapin(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  char *mem;
+  uint slot;
+
+  if((mem = kalloc_user(0)) == 0)
+    return 0;
+  if((pte = walk(pagetable, va, 0)) == 0 || (*pte & PTE_S) == 0){
+    kfree(mem);
+    return 0;
+  }
+  slot = PTE2SLOT(*pte);
+  swapread(slot, mem);
+  *pte = PA2PTE(mem) | (PTE_FLAGS(*pte) & ~PTE_S) | PTE_V | PTE_A;
+  tlbflush(pagetable, va, 1);
+  swapfree(slot);
+  return (uint64)mem;
+}
+
+// Choose a cold page of q to page out to swap slot slot, with a
+// clock algorithm: go around q's heap and mapped regions from
+// q->swaphand, clearing accessed bits, until a page is found
+// whose bit was already clear. Pages shared with anything else
+// (copy-on-write, the page cache, MAP_SHARED) are passed over.
+// The victim's PTE is replaced by one holding slot. Gives up
+// after looking at SWAPSCAN pages.
+// Caller must hold q->lock, and q must not be running anywhere
+// except in the caller.
+// returns the victim's physical address, which the caller must
+// write to the slot and then kfree(), or 0 if none was found.
+uint64
+uvmevict(struct proc *q, uint slot)
+{
+  uint64 va = q->swaphand, pa;
+  struct vma *v, *u;
+  pte_t *pte;
+  int level;
+
+  for(int n = 0; n < SWAPSCAN; n++, va += PGSIZE){
+    // the next page of the heap or of a region, or wrap around.
+    if(va >= q->sz){
+      u = 0;
+      for(v = q->vma; v < &q->vma[NVMA]; v++){
+        if(v->flags && v->end > va && (u == 0 || v->start < u->start))
+          u = v;
+      }
+      va = u == 0 ? 0 : (u->start > va ? u->start : va);
+    }
+    if(va >= MAXVA)
+      break;
+    if((pte = leafpte(q->pagetable, va, &level)) == 0){
+      va = SUPERPGROUNDDOWN(va) + SUPERPGSIZE - PGSIZE;  // no page table here
+      continue;
+    }
+    if((*pte & (PTE_V|PTE_U)) != (PTE_V|PTE_U))
+      continue;
+    if((v = vmalookup(q, va)) != 0 && (v->flags & MAP_SHARED))
+      continue;
+    if(*pte & PTE_A){
+      *pte &= ~PTE_A;
+      asidflush(q, va);
+      if(level == 1)
+        va = SUPERPGROUNDDOWN(va) + SUPERPGSIZE - PGSIZE;
+      continue;
+    }
+    if(level == 1){
+      // page out only 4096 bytes of it.
+      if(demote(pte, 0) < 0)
+        continue;
+      pte = walk(q->pagetable, va, 0);
+    }
+    pa = PTE2PA(*pte);
+    if(krefcnt((void*)pa) != 1)
+      continue;
+    *pte = SLOT2PTE(slot) | (PTE_FLAGS(*pte) & ~(PTE_V|PTE_A)) | PTE_S;
+    asidflush(q, va);
+    q->swaphand = va + PGSIZE;
+    return pa;
   }
+  q->swaphand = va;
+  return 0;
+}
+
+// vmfault() for page va of process p (the first thread's
+// struct proc, holding what the threads share).
+static uint64
+pagefault(struct proc *p, pagetable_t pagetable, uint64 va, int read)
+{
+  struct vma *v;
+  pte_t *pte;
+  int level;
+
+  if((pte = leafpte(pagetable, va, &level)) != 0 && (*pte & PTE_S))
+    return swapin(pagetable, va);
+  if(pte && (*pte & PTE_V)) {
+    // another thread may have mapped it while this one waited
+    // for the vmlock, or this CPU's TLB may have been behind.
+    if((*pte & PTE_U) && (read || (*pte & PTE_W)))
+      return walkaddr(pagetable, va);
+    if(read)
+      return 0;
+    return uvmcow(pagetable, va);
+  }
+  if((v = vmalookup(p, va)) != 0){
+    if(!read && (v->perm & PTE_W) == 0)
+      return 0;
+    return vmafault(pagetable, v, va);
+  }
+  if (va >= p->sz)
+    return 0;
+  return heapfault(p, pagetable, va);
 }
 
 // allocate and map user memory if process is referencing a page
-// that was lazily allocated in sys_sbrk().
-// returns 0 if va is invalid or already mapped, or if
-// out of physical memory, and physical address if successful.
+// that was lazily allocated in sys_sbrk() or that belongs to a
+// mapped region not yet filled in, copy a copy-on-write page
+// that the process is writing to, or read back a paged-out one.
+// returns 0 if va is invalid or not accessible, or if out of
+// physical memory, and physical address if successful.
 uint64
 vmfault(pagetable_t pagetable, uint64 va, int read)
 {
-  uint64 mem;
   struct proc *p = myproc();
+  uint64 pa;
+  int locked;
 
-  if (va >= p->sz)
-    return 0;
-  va = PGROUNDDOWN(va);
-  if(ismapped(pagetable, va)) {
+  if (va >= MAXVA)
     return 0;
+  locked = vmlock(p);
+  pa = pagefault(p->group, pagetable, PGROUNDDOWN(va), read);
+  if(locked)
+    vmunlock(p);
+  return pa;
+}
+
+// Return p's region containing va, or 0.
+struct vma*
+vmalookup(struct proc *p, uint64 va)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->flags && va >= v->start && va < v->end)
+      return v;
   }
-  mem = (uint64) kalloc();
-  if(mem == 0)
+  return 0;
+}
+
+// Lowest address in use by p's mmap regions, which
+// the heap must not grow into.
+uint64
+mmapbase(struct proc *p)
+{
+  uint64 base = MMAPTOP;
+
+  for(struct vma *v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->flags && v->start >= p->sz && v->start < base)
+      base = v->start;
+  }
+  return base;
+}
+
+// Find room for len bytes of mmap regions in p, below MMAPTOP
+// and above the heap. len must be page-aligned.
+// returns the start address, or 0 if there is no room.
+uint64
+mmapalloc(struct proc *p, uint64 len)
+{
+  struct vma *v;
+  uint64 a;
+
+  if(len > MMAPTOP)
     return 0;
-  memset((void *) mem, 0, PGSIZE);
-  if (mappages(p->pagetable, va, PGSIZE, mem, PTE_W|PTE_U|PTE_R) != 0) {
-    kfree((void *)mem);
+  a = MMAPTOP - len;
+ again:
+  if(a < PGROUNDUP(p->sz))
     return 0;
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->flags && v->start < a + len && a < v->end){
+      if(v->start < len)
+        return 0;
+      a = v->start - len;
+      goto again;
+    }
   }
-  return mem;
+  return a;
+}
+
+// Give p's child np copies of p's regions. Pages of the
+// mmap regions are shared as uvmcopy() shares the heap,
+// except that MAP_SHARED pages stay writable in both.
+// returns 0 on success, -1 on failure, leaving np with no
+// regions on failure.
+int
+vmacopy(struct proc *p, struct proc *np)
+{
+  struct vma *v;
+  int i;
+
+  for(i = 0; i < NVMA; i++){
+    v = &p->vma[i];
+    if(v->flags == 0 || v->start < p->sz)
+      continue;   // free, or below sz and so copied by uvmcopy()
+    if(copyrange(p->pagetable, np->pagetable, v->start, v->end, v->flags & MAP_SHARED) < 0)
+      goto err;
+  }
+  for(i = 0; i < NVMA; i++){
+    np->vma[i] = p->vma[i];
+    if(p->vma[i].ip)
+      idup(p->vma[i].ip);
+    if(p->vma[i].shm)
+      shmdup(p->vma[i].shm);
+  }
+  return 0;
+
+ err:
+  while(--i >= 0){
+    v = &p->vma[i];
+    if(v->flags && v->start >= p->sz)
+      uvmunmap(np->pagetable, v->start, (v->end - v->start) / PGSIZE, 1);
+  }
+  return -1;
+}
+
+// Write the page at va of MAP_SHARED region v back to its file,
+// without extending the file.
+static void
+vmawrite(struct vma *v, uint64 va, uint64 pa)
+{
+  uint off = v->off + (va - v->start);
+  uint n = PGSIZE;
+
+  if(va - v->start >= v->filesz)
+    return;
+  if(n > v->filesz - (va - v->start))
+    n = v->filesz - (va - v->start);
+  begin_op();
+  ilock(v->ip);
+  if(off < v->ip->size){
+    if(n > v->ip->size - off)
+      n = v->ip->size - off;
+    writei(v->ip, 0, pa, off, n);
+  }
+  iunlock(v->ip);
+  end_op();
+}
+
+// Unmap [start, end) of region v, writing modified pages of a
+// MAP_SHARED file mapping back to the file. The range must
+// be page-aligned and include the start or the end of v.
+// Frees the region once nothing of it is left.
+// Must not be called inside a transaction.
+void
+vmaunmap(pagetable_t pagetable, struct vma *v, uint64 start, uint64 end)
+{
+  pte_t *pte;
+  uint64 a;
+
+  for(a = start; v->ip && (v->flags & MAP_SHARED) && a < end; a += PGSIZE){
+    if((pte = walk(pagetable, a, 0)) != 0 && (*pte & PTE_V) && (*pte & PTE_D))
+      vmawrite(v, a, PTE2PA(*pte));
+  }
+  uvmunmap(pagetable, start, (end - start) / PGSIZE, 1);
+
+  if(start == v->start && end < v->end){
+    v->filesz = v->filesz > end - start ? v->filesz - (end - start) : 0;
+    v->off += end - start;
+    v->start = end;
+  } else if(start > v->start){
+    v->end = start;
+  } else {
+    if(v->ip){
+      begin_op();
+      iput(v->ip);
+      end_op();
+    }
+    if(v->shm)
+      shmput(v->shm);
+    memset(v, 0, sizeof(*v));
+  }
+}
+
+// Take advice about how p will use [addr, addr+len), which must
+// lie in its heap or its mapped regions. The heap has one advice
+// for all of it. MADV_WILLNEED maps the range's pages now.
+// returns 0 on success, -1 on a bad range or out of memory.
+int
+uvmadvise(struct proc *p, uint64 addr, uint64 len, int advice)
+{
+  struct vma *v;
+  uint64 a, end;
+
+  if(addr % PGSIZE != 0 || advice < MADV_NORMAL || advice > MADV_WILLNEED)
+    return -1;
+  end = PGROUNDUP(addr + len);
+  if(end < addr || end > MAXVA)
+    return -1;
+  for(a = addr; a < end; a += PGSIZE){
+    if(a >= p->sz && vmalookup(p, a) == 0)
+      return -1;
+  }
+
+  for(a = addr; a < end; a += PGSIZE){
+    if(advice == MADV_WILLNEED){
+      if(!ismapped(p->pagetable, a) && vmfault(p->pagetable, a, 1) == 0)
+        return -1;
+    } else if((v = vmalookup(p, a)) != 0){
+      v->advice = advice;
+    } else {
+      p->heapadvice = advice;
+    }
+  }
+  return 0;
 }
 
+// Is va mapped, or paged out?
 int
 ismapped(pagetable_t pagetable, uint64 va)
 {
-  pte_t *pte = walk(pagetable, va, 0);
+  int level;
+  pte_t *pte = leafpte(pagetable, va, &level);
   if (pte == 0) {
     return 0;
   }
-  if (*pte & PTE_V){
+  if (*pte & (PTE_V|PTE_S)){
     return 1;
   }
   return 0;
@@ -1,2 +1,8 @@
 #define SBRK_EAGER 1
 #define SBRK_LAZY  2
+
+// madvise() advice
+#define MADV_NORMAL     0  // guess from the faults so far
+#define MADV_RANDOM     1  // map only the faulting page
+#define MADV_SEQUENTIAL 2  // map FAULTAHEAD pages per fault
+#define MADV_WILLNEED   3  // map the range now
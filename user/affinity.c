@@ -0,0 +1,130 @@
+// Measure what a process loses when it moves between CPUs.
+//
+// usage: affinity [rounds]
+//
+// Runs one worker per CPU three times: free to run anywhere
+// (the kernel keeps each on the CPU it last ran on unless the
+// CPU has too much to do), pinned with sched_setaffinity() to
+// a CPU of its own, and made to move to the next CPU before
+// every round, as a scheduler that picked any CPU would do. In
+// each round a worker sweeps a working set that fits in the
+// caches and TLB once to warm them, then times more sweeps;
+// the times of the three runs show what that warmth is worth.
+
+#include "kernel/types.h"
+#include "kernel/riscv.h"
+#include "user/user.h"
+
+#define WSET   (64*1024)  // bytes each worker sweeps
+#define SWEEPS 8          // timed sweeps per round
+#define LINE   64
+
+enum { FREE, PINNED, BOUNCE };
+char *modes[] = { "free", "pinned", "bounce" };
+
+// the CPU numbers in mask, in order.
+int
+cpulist(uint64 mask, int *cpu)
+{
+  int n = 0;
+
+  for(int i = 0; i < 64; i++)
+    if(mask & (1L << i))
+      cpu[n++] = i;
+  return n;
+}
+
+// one worker's rounds; returns the cycles its timed sweeps took.
+uint64
+work(int mode, int *cpu, int ncpu, int me, int rounds)
+{
+  volatile char *buf = malloc(WSET);
+  uint64 t0, total = 0;
+  int r, s, i, sum = 0;
+
+  if(buf == 0){
+    fprintf(2, "affinity: out of memory\n");
+    exit(1);
+  }
+  memset((char*)buf, me, WSET);
+  if(mode == PINNED && sched_setaffinity(0, 1L << cpu[me % ncpu]) != 0){
+    fprintf(2, "affinity: sched_setaffinity failed\n");
+    exit(1);
+  }
+  for(r = 0; r < rounds; r++){
+    if(mode == BOUNCE)
+      sched_setaffinity(0, 1L << cpu[(me + r) % ncpu]);
+    for(i = 0; i < WSET; i += LINE)
+      sum += buf[i];
+    t0 = r_time();
+    for(s = 0; s < SWEEPS; s++)
+      for(i = 0; i < WSET; i += LINE)
+        sum += buf[i];
+    total += r_time() - t0;
+  }
+  if(sum == 1)
+    printf("%d\n", sum);  // keep the sweeps
+  return total;
+}
+
+// run a worker per CPU in mode; returns their average
+// time per sweep, in time-CSR cycles.
+uint64
+run(int mode, int *cpu, int ncpu, int rounds)
+{
+  int fds[2], i;
+  uint64 t, total = 0;
+
+  if(pipe(fds) < 0){
+    fprintf(2, "affinity: pipe failed\n");
+    exit(1);
+  }
+  for(i = 0; i < ncpu; i++){
+    int pid = fork();
+    if(pid < 0){
+      fprintf(2, "affinity: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      close(fds[0]);
+      t = work(mode, cpu, ncpu, i, rounds);
+      write(fds[1], &t, sizeof(t));
+      exit(0);
+    }
+  }
+  close(fds[1]);
+  for(i = 0; i < ncpu; i++){
+    if(read(fds[0], &t, sizeof(t)) != sizeof(t)){
+      fprintf(2, "affinity: worker failed\n");
+      exit(1);
+    }
+    total += t;
+    wait(0);
+  }
+  close(fds[0]);
+  return total / ((uint64)ncpu * rounds * SWEEPS);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int cpu[64], ncpu, rounds = 50, mode;
+  uint64 mask;
+
+  if(argc > 1)
+    rounds = atoi(argv[1]);
+  if(rounds <= 0){
+    fprintf(2, "usage: affinity [rounds]\n");
+    exit(1);
+  }
+  if(sched_getaffinity(0, &mask) != 0){
+    fprintf(2, "affinity: sched_getaffinity failed\n");
+    exit(1);
+  }
+  ncpu = cpulist(mask, cpu);
+
+  printf("%d workers, %d rounds of %d sweeps of %d bytes\n", ncpu, rounds, SWEEPS, WSET);
+  for(mode = FREE; mode <= BOUNCE; mode++)
+    printf("%s: %d cycles per sweep\n", modes[mode], (int)run(mode, cpu, ncpu, rounds));
+  exit(0);
+}
@@ -20,6 +20,7 @@ main(void)
     mknod("console", CONSOLE, 0);
     open("console", O_RDWR);
   }
+  mknod("lockstat", LOCKSTAT, 0);  // fails if it's there already
   dup(0);  // stdout
   dup(0);  // stderr
 
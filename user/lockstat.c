@@ -0,0 +1,116 @@
+// Show which spinlocks the kernel spends its time spinning on.
+//
+// usage: lockstat [-r] [-n count] [command [arg ...]]
+//
+// Reads the lockstat device, which counts for each lock name
+// the acquisitions, the acquisitions that had to spin, the times
+// round the spin loop and the longest hold (in time-CSR cycles),
+// and prints the count (default 10) names spun on most. -r zeroes
+// the counts instead. Given a command, zeroes the counts, runs
+// the command, and prints the counts for its run.
+
+#include "kernel/types.h"
+#include "kernel/fcntl.h"
+#include "kernel/ioctl.h"
+#include "kernel/lockstat.h"
+#include "user/user.h"
+
+#define MAXLOCKS 128
+
+struct lockstat st[MAXLOCKS];
+
+// print x right-aligned in a field w wide.
+void
+field(uint64 x, int w)
+{
+  char buf[24];
+  int i = sizeof(buf) - 1;
+
+  buf[i] = 0;
+  do {
+    buf[--i] = '0' + x % 10;
+    x /= 10;
+  } while(x);
+  for(w -= sizeof(buf) - 1 - i; w > 0; w--)
+    printf(" ");
+  printf("%s", buf + i);
+}
+
+// does a come before b: more spins, then more contention,
+// then more acquisitions.
+int
+before(struct lockstat *a, struct lockstat *b)
+{
+  if(a->spin != b->spin)
+    return a->spin > b->spin;
+  if(a->contend != b->contend)
+    return a->contend > b->contend;
+  return a->acquire > b->acquire;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int fd, n, i, j, count = 10, reset = 0;
+  struct lockstat t;
+
+  for(i = 1; i < argc && argv[i][0] == '-'; i++){
+    if(strcmp(argv[i], "-r") == 0)
+      reset = 1;
+    else if(strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+      count = atoi(argv[++i]);
+    else {
+      fprintf(2, "usage: lockstat [-r] [-n count] [command [arg ...]]\n");
+      exit(1);
+    }
+  }
+  if((fd = open("/lockstat", O_RDONLY)) < 0){
+    fprintf(2, "lockstat: cannot open /lockstat\n");
+    exit(1);
+  }
+
+  if(reset || i < argc){
+    if(ioctl(fd, LOCKSTAT_RESET, 0) < 0){
+      fprintf(2, "lockstat: reset failed\n");
+      exit(1);
+    }
+    if(i == argc)
+      exit(0);
+    int pid = fork();
+    if(pid < 0){
+      fprintf(2, "lockstat: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      close(fd);
+      exec(argv[i], argv + i);
+      fprintf(2, "lockstat: exec %s failed\n", argv[i]);
+      exit(1);
+    }
+    wait(0);
+  }
+
+  for(n = 0; n < MAXLOCKS && read(fd, &st[n], sizeof(st[n])) == sizeof(st[n]); n++)
+    ;
+  close(fd);
+
+  for(i = 1; i < n; i++){
+    t = st[i];
+    for(j = i; j > 0 && before(&t, &st[j-1]); j--)
+      st[j] = st[j-1];
+    st[j] = t;
+  }
+
+  printf("lock              acquire     contend        spin     maxhold\n");
+  for(i = 0; i < n && i < count; i++){
+    printf("%s", st[i].name);
+    for(j = strlen(st[i].name); j < 16; j++)
+      printf(" ");
+    field(st[i].acquire, 9);
+    field(st[i].contend, 12);
+    field(st[i].spin, 12);
+    field(st[i].maxhold, 12);
+    printf("\n");
+  }
+  exit(0);
+}
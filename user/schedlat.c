@@ -0,0 +1,100 @@
+// Measure how long an interactive process waits for the CPU
+// while CPU-bound processes are running.
+//
+// usage: schedlat [-n] [hogs]
+//
+// Starts hogs (default 4) processes that spin forever, niced
+// with -n, then has two processes bounce a byte through a pair
+// of pipes, pausing for a tick between rounds as an interactive
+// program would between keystrokes. Prints the round trips'
+// average and worst times, in ticks. Compare runs of a kernel
+// booted with make SCHED=rr (the default) and SCHED=mlfq.
+
+#include "kernel/types.h"
+#include "kernel/riscv.h"
+#include "kernel/memlayout.h"
+#include "user/user.h"
+
+#define ROUNDS 20
+#define MAXHOGS 16
+
+// print cycles as ticks, with two decimals.
+void
+printticks(char *what, uint64 cycles)
+{
+  uint64 t = cycles * 100 / ((struct usyscall *)USYSCALL)->timebase;
+
+  printf("%s %d.%d%d ticks\n", what, (int)(t / 100), (int)(t / 10 % 10), (int)(t % 10));
+}
+
+int
+main(int argc, char *argv[])
+{
+  int hogs = 4, niced = 0, pid[MAXHOGS], i, echo;
+  int ping[2], pong[2];
+  uint64 t0, t, total = 0, worst = 0;
+  char c = 0;
+
+  for(i = 1; i < argc; i++){
+    if(strcmp(argv[i], "-n") == 0)
+      niced = 1;
+    else
+      hogs = atoi(argv[i]);
+  }
+  if(hogs < 0 || hogs > MAXHOGS){
+    fprintf(2, "usage: schedlat [-n] [hogs <= %d]\n", MAXHOGS);
+    exit(1);
+  }
+
+  for(i = 0; i < hogs; i++){
+    if((pid[i] = fork()) < 0){
+      fprintf(2, "schedlat: fork failed\n");
+      exit(1);
+    }
+    if(pid[i] == 0){
+      if(niced)
+        nice(2);
+      for(;;)
+        ;
+    }
+  }
+
+  if(pipe(ping) < 0 || pipe(pong) < 0 || (echo = fork()) < 0){
+    fprintf(2, "schedlat: pipe or fork failed\n");
+    exit(1);
+  }
+  if(echo == 0){
+    while(read(ping[0], &c, 1) == 1)
+      write(pong[1], &c, 1);
+    exit(0);
+  }
+  close(ping[0]);
+  close(pong[1]);
+
+  // let the hogs use up their quanta.
+  pause(5);
+  for(i = 0; i < ROUNDS; i++){
+    pause(1);
+    t0 = r_time();
+    if(write(ping[1], &c, 1) != 1 || read(pong[0], &c, 1) != 1){
+      fprintf(2, "schedlat: echo failed\n");
+      exit(1);
+    }
+    t = r_time() - t0;
+    total += t;
+    if(t > worst)
+      worst = t;
+  }
+  close(ping[1]);
+  wait(0);
+
+  for(i = 0; i < hogs; i++){
+    kill(pid[i]);
+    wait(0);
+  }
+
+  printf("%d hogs%s, %d round trips\n", hogs, niced ? " (niced)" : "", ROUNDS);
+  printticks("average", total / ROUNDS);
+  printticks("worst  ", worst);
+  exit(0);
+}
@@ -0,0 +1,100 @@
+// Threads, on top of clone() and join().
+//
+// thread_create() gives each thread a stack from malloc(),
+// and thread_join() frees it once the thread is gone.
+
+#include "kernel/types.h"
+#include "kernel/riscv.h"
+#include "kernel/param.h"
+#include "user/user.h"
+
+#define STACKSIZE (4*PGSIZE)
+
+// what a new thread starts, at the top of its stack.
+struct start {
+  void (*fn)(void*);
+  void *arg;
+};
+
+// the stacks of threads not yet joined.
+static struct {
+  struct mutex lock;
+  int tid[NPROC];
+  void *stack[NPROC];
+} threads;
+
+static void
+start(void *a)
+{
+  struct start *s = a;
+
+  s->fn(s->arg);
+  exit(0);
+}
+
+int
+thread_create(void (*fn)(void*), void *arg)
+{
+  char *stack;
+  struct start *s;
+  int i, tid;
+
+  if((stack = malloc(STACKSIZE)) == 0)
+    return -1;
+  mutex_lock(&threads.lock);
+  for(i = 0; i < NPROC; i++)
+    if(threads.stack[i] == 0)
+      break;
+  if(i == NPROC){
+    mutex_unlock(&threads.lock);
+    free(stack);
+    return -1;
+  }
+  threads.stack[i] = stack;
+  threads.tid[i] = 0;
+  mutex_unlock(&threads.lock);
+
+  // the stack pointer must stay 16-byte aligned.
+  s = (struct start*)((uint64)(stack + STACKSIZE - sizeof(*s)) & ~15L);
+  s->fn = fn;
+  s->arg = arg;
+  if((tid = clone(start, s, s)) < 0){
+    mutex_lock(&threads.lock);
+    threads.stack[i] = 0;
+    mutex_unlock(&threads.lock);
+    free(stack);
+    return -1;
+  }
+  mutex_lock(&threads.lock);
+  threads.tid[i] = tid;
+  mutex_unlock(&threads.lock);
+  return tid;
+}
+
+int
+thread_join(int tid, int *status)
+{
+  void *stack = 0;
+  int i;
+
+  if(join(tid, status) < 0)
+    return -1;
+  mutex_lock(&threads.lock);
+  for(i = 0; i < NPROC; i++){
+    if(threads.stack[i] && threads.tid[i] == tid){
+      stack = threads.stack[i];
+      threads.stack[i] = 0;
+      break;
+    }
+  }
+  mutex_unlock(&threads.lock);
+  if(stack)
+    free(stack);
+  return 0;
+}
+
+void
+thread_exit(int status)
+{
+  exit(status);
+}
@@ -1,8 +1,10 @@
 #include "kernel/types.h"
 #include "kernel/fcntl.h"
 #include "kernel/riscv.h"
+#include "kernel/memlayout.h"
 #include "kernel/stat.h"
 #include "kernel/vm.h"
+#include "kernel/param.h"
 #include "user/user.h"
 
 //
@@ -155,6 +157,73 @@ char *sbrk(int n) { return sys_sbrk(n, SBRK_EAGER); }
 
 char *sbrklazy(int n) { return sys_sbrk(n, SBRK_LAZY); }
 
+int getpid(void) { return ((struct usyscall *)USYSCALL)->pid; }
+
+int uptime(void) { return ((volatile struct usyscall *)USYSCALL)->ticks; }
+
+// A mutex's state is 0 when unlocked, 1 when locked, and 2 when
+// locked and someone may be waiting in futex_wait(), so that
+// mutex_unlock() calls futex_wake() only then. (Drepper,
+// "Futexes Are Tricky".)
+
+void mutex_init(struct mutex *m) { m->state = 0; }
+
+void mutex_lock(struct mutex *m) {
+    int c = 0;
+
+    if (__atomic_compare_exchange_n(&m->state, &c, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return;
+    // contended: say so, and sleep until the holder lets go.
+    if (c != 2) c = __atomic_exchange_n(&m->state, 2, __ATOMIC_ACQUIRE);
+    while (c != 0) {
+        futex_wait(&m->state, 2);
+        c = __atomic_exchange_n(&m->state, 2, __ATOMIC_ACQUIRE);
+    }
+}
+
+int mutex_trylock(struct mutex *m) {
+    int c = 0;
+
+    return __atomic_compare_exchange_n(&m->state, &c, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED) ? 0 : -1;
+}
+
+void mutex_unlock(struct mutex *m) {
+    if (__atomic_exchange_n(&m->state, 0, __ATOMIC_RELEASE) == 2) futex_wake(&m->state, 1);
+}
+
+// A condition variable's seq changes at every signal, so that
+// a waiter whose futex_wait() comes after one doesn't sleep;
+// waiters counts the threads in cond_wait(), so that signals
+// with none waiting stay in user space.
+
+void cond_init(struct cond *c) {
+    c->seq = 0;
+    c->waiters = 0;
+}
+
+void cond_wait(struct cond *c, struct mutex *m) {
+    int seq;
+
+    // count ourselves before reading seq: a signal that
+    // doesn't see us has already changed seq.
+    __atomic_fetch_add(&c->waiters, 1, __ATOMIC_SEQ_CST);
+    seq = __atomic_load_n(&c->seq, __ATOMIC_SEQ_CST);
+    mutex_unlock(m);
+    futex_wait(&c->seq, seq);
+    __atomic_fetch_sub(&c->waiters, 1, __ATOMIC_SEQ_CST);
+    // others woken with us may be after m too.
+    while (__atomic_exchange_n(&m->state, 2, __ATOMIC_ACQUIRE) != 0) futex_wait(&m->state, 2);
+}
+
+void cond_signal(struct cond *c) {
+    __atomic_fetch_add(&c->seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&c->waiters, __ATOMIC_SEQ_CST) > 0) futex_wake(&c->seq, 1);
+}
+
+void cond_broadcast(struct cond *c) {
+    __atomic_fetch_add(&c->seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&c->waiters, __ATOMIC_SEQ_CST) > 0) futex_wake(&c->seq, NPROC);
+}
+
 static unsigned find_prev_slash(char *path, unsigned dst_idx) {
     int new_dst_idx = dst_idx - 1;
     while (new_dst_idx >= 0) {
@@ -1,5 +1,6 @@
 #include "kernel/types.h"
 #define SBRK_ERROR ((char *)-1)
+#define MAP_FAILED ((void *)-1)
 
 struct stat;
 
@@ -135,10 +136,11 @@ int chdir(const char* path);
 int dup(int fd);
 
 /**
- * Get the current process ID.
+ * Get the current process ID (raw system call; getpid() in
+ * ulib.c reads it from the usyscall page instead).
  * @return The process ID (PID).
  */
-int getpid(void);
+int sys_getpid(void);
 
 /**
  * Adjust the process heap size (raw system call).
@@ -150,21 +152,172 @@ char* sys_sbrk(int n, int reserved);
 /**
  * Pause execution for a specified duration.
  * @param ticks Number of clock ticks to sleep.
- * @return 0 on success.
+ * @return 0 on success, -1 if killed.
  */
 int pause(int ticks);
 
 /**
- * Get the time since system startup.
+ * Get the time since system startup (raw system call; uptime()
+ * in ulib.c reads it from the usyscall page instead).
  * @return Number of clock ticks.
  */
-int uptime(void);
+int sys_uptime(void);
 
 /**
  * some description for ioctl
  */
 int ioctl(int fd, int req, uint64 arg);
 
+/**
+ * Map a file, or zero-filled memory, into the address space.
+ * Pages are read in when first touched.
+ * @param addr  Ignored; the kernel chooses the address.
+ * @param len   Number of bytes to map.
+ * @param prot  PROT_READ, PROT_WRITE and/or PROT_EXEC.
+ * @param flags MAP_SHARED or MAP_PRIVATE, optionally with MAP_ANONYMOUS.
+ * @param fd    Open file to map (ignored with MAP_ANONYMOUS).
+ * @param off   Page-aligned offset in the file.
+ * @return Address of the mapping, or MAP_FAILED on error.
+ */
+void* mmap(void* addr, uint64 len, int prot, int flags, int fd, int off);
+
+/**
+ * Unmap part of a mapping made by mmap(), writing modified
+ * MAP_SHARED pages back to the file.
+ * @param addr Page-aligned start; the range must cover the
+ *             first or the last page of the mapping.
+ * @param len  Number of bytes to unmap.
+ * @return 0 on success, -1 on error.
+ */
+int munmap(void* addr, uint64 len);
+
+/**
+ * Tell the kernel how a range of the heap or of a mapping will
+ * be used, so page faults can map pages ahead of need.
+ * @param addr   Page-aligned start.
+ * @param len    Number of bytes.
+ * @param advice MADV_NORMAL, MADV_RANDOM or MADV_SEQUENTIAL (for
+ *               the whole heap if the range is in it), or
+ *               MADV_WILLNEED to map the range now.
+ * @return 0 on success, -1 on error.
+ */
+int madvise(void* addr, uint64 len, int advice);
+
+/**
+ * Find the shared memory segment with a key, or create it.
+ * @param key  Key naming the segment; 0 always creates a new one.
+ * @param size Size in bytes; must not exceed an existing segment's.
+ * @return Segment id, or -1 on error.
+ */
+int shmget(int key, uint64 size);
+
+/**
+ * Map a shared memory segment into the address space. Every
+ * process that attaches it sees the same pages, and fork
+ * keeps attachments.
+ * @param id   Segment id from shmget().
+ * @param addr Page-aligned address above the heap, or 0 to let
+ *             the kernel choose.
+ * @return Address of the segment, or MAP_FAILED on error.
+ */
+void* shmat(int id, void* addr);
+
+/**
+ * Unmap a segment attached by shmat(). The segment is freed
+ * when the last process attached to it detaches or exits.
+ * @param addr Address shmat() returned.
+ * @return 0 on success, -1 on error.
+ */
+int shmdt(void* addr);
+
+/**
+ * Control a shared memory segment. The only command is
+ * IPC_RMID, which removes the segment: shmget() no longer finds
+ * its key, and it is freed once nothing has it attached, which
+ * may be at once.
+ * @param id  Segment id from shmget().
+ * @param cmd IPC_RMID.
+ * @return 0 on success, -1 on error.
+ */
+int shmctl(int id, int cmd);
+
+/**
+ * Lower (or, with a negative inc, raise) the priority of the
+ * calling process. Only the sched=mlfq scheduler uses it.
+ * @param inc Amount to add to the nice level.
+ * @return The new nice level, from 0 (highest priority) to 2.
+ */
+int nice(int inc);
+
+/**
+ * Sleep for a number of microseconds, to within about a
+ * millisecond rather than a clock tick.
+ * @param usec Microseconds to sleep.
+ * @return 0 on success, -1 if killed or usec is too large.
+ */
+int usleep(uint64 usec);
+
+/**
+ * Let a process run only on some CPUs.
+ * @param pid Process to change, or 0 for the calling process.
+ * @param mask CPUs it may run on: bit i for CPU i.
+ * @return 0 on success, -1 if there is no such process or mask
+ *         names no CPU that is running.
+ */
+int sched_setaffinity(int pid, uint64 mask);
+
+/**
+ * Find out which CPUs a process may run on.
+ * @param pid Process to ask about, or 0 for the calling process.
+ * @param mask Where to store the mask: bit i for CPU i.
+ * @return 0 on success, -1 if there is no such process.
+ */
+int sched_getaffinity(int pid, uint64 *mask);
+
+/**
+ * Start a new thread in the calling process, sharing its memory
+ * and open files. The thread begins at fn(arg) on the given
+ * stack, and must end with exit() rather than return; exit() in
+ * it ends only that thread. thread_create() is easier to use.
+ * @param fn    Function the thread runs.
+ * @param arg   Argument passed to fn.
+ * @param stack Top of the thread's stack, 16-byte aligned.
+ * @return The new thread's id, or -1 on error.
+ */
+int clone(void (*fn)(void*), void *arg, void *stack);
+
+/**
+ * Wait for a thread of the calling process to exit, and free it.
+ * The process's first thread can't be joined; its exit() ends
+ * the whole process.
+ * @param tid    Thread id from clone().
+ * @param status Where to store its exit status, or 0.
+ * @return 0 on success, -1 if there is no such thread.
+ */
+int join(int tid, int *status);
+
+/**
+ * Sleep until a futex_wake() on addr, but only if *addr still
+ * holds val when the kernel looks, so that a wakeup sent after
+ * the caller last read *addr isn't missed. Threads, and processes
+ * that share the memory, meet at the same futex wherever they map
+ * the word. Callers must check again when it returns, since it
+ * may return for other reasons. The mutex and cond functions in
+ * ulib.c are easier to use.
+ * @param addr A 4-byte aligned int.
+ * @param val  The value *addr must hold for the caller to sleep.
+ * @return 0 when woken, -1 if *addr wasn't val or addr is bad.
+ */
+int futex_wait(int *addr, int val);
+
+/**
+ * Wake processes sleeping in futex_wait() on addr.
+ * @param addr A 4-byte aligned int.
+ * @param n    The most processes to wake.
+ * @return The number woken, or -1 if addr is bad.
+ */
+int futex_wake(int *addr, int n);
+
 //==============================================================================
 // ulib.c (User Library)
 //==============================================================================
@@ -292,6 +445,21 @@ char* sbrk(int increment);
  */
 char* sbrklazy(int increment);
 
+/**
+ * Get the current process ID.
+ * Reads the usyscall page, without a system call.
+ * @return The process ID (PID).
+ */
+int getpid(void);
+
+/**
+ * Get the time since system startup.
+ * Reads the usyscall page, without a system call; the value
+ * can lag the kernel's clock by a tick.
+ * @return Number of clock ticks.
+ */
+int uptime(void);
+
 /**
  * Canonicalize a path (resolving symbols like ".." and ".").
  * @param path The path buffer to be canonicalized in-place.
@@ -307,6 +475,77 @@ void canonicalize_path(char* path);
  */
 unsigned get_char_offset(const char* path, char c, int num);
 
+/**
+ * A lock for threads, or for processes sharing memory, that
+ * sleeps in futex_wait() while another holds it. Locking and
+ * unlocking make no system calls unless the lock is contended.
+ * A zeroed struct mutex is unlocked.
+ */
+struct mutex {
+  int state;
+};
+
+/**
+ * A condition variable, used with a struct mutex.
+ * A zeroed struct cond is ready to use.
+ */
+struct cond {
+  int seq;
+  int waiters;
+};
+
+/**
+ * Initialize a mutex, unlocked.
+ * @param m The mutex.
+ */
+void mutex_init(struct mutex* m);
+
+/**
+ * Lock a mutex, waiting for it if another holds it.
+ * @param m The mutex.
+ */
+void mutex_lock(struct mutex* m);
+
+/**
+ * Lock a mutex if no one holds it.
+ * @param m The mutex.
+ * @return 0 if locked, -1 if another holds it.
+ */
+int mutex_trylock(struct mutex* m);
+
+/**
+ * Unlock a mutex the caller holds.
+ * @param m The mutex.
+ */
+void mutex_unlock(struct mutex* m);
+
+/**
+ * Initialize a condition variable.
+ * @param c The condition variable.
+ */
+void cond_init(struct cond* c);
+
+/**
+ * Unlock m and wait for a cond_signal() or cond_broadcast() on
+ * c, then lock m again. May return without one, so callers
+ * should check their condition in a loop.
+ * @param c The condition variable.
+ * @param m A mutex the caller holds.
+ */
+void cond_wait(struct cond* c, struct mutex* m);
+
+/**
+ * Wake one thread waiting in cond_wait() on c, if any.
+ * @param c The condition variable.
+ */
+void cond_signal(struct cond* c);
+
+/**
+ * Wake all the threads waiting in cond_wait() on c.
+ * @param c The condition variable.
+ */
+void cond_broadcast(struct cond* c);
+
 //==============================================================================
 // printf.c
 //==============================================================================
@@ -353,4 +592,34 @@ void free(void* ap);
  * @param text    Text to search.
  * @return 1 on match, 0 on no match.
  */
-int regex_match(char *pattern, char *text);
\ No newline at end of file
+int regex_match(char *pattern, char *text);
+
+//==============================================================================
+// thread.c
+//==============================================================================
+
+/**
+ * Start a thread running fn(arg) on a stack of its own, in the
+ * calling process. malloc() and free() may be used from any thread.
+ * @param fn  Function the thread runs; the thread exits with
+ *            status 0 when it returns.
+ * @param arg Argument passed to fn.
+ * @return The new thread's id, or -1 on error.
+ */
+int thread_create(void (*fn)(void*), void *arg);
+
+/**
+ * Wait for a thread made by thread_create() to finish, and free
+ * its stack.
+ * @param tid    Thread id from thread_create().
+ * @param status Where to store its exit status, or 0.
+ * @return 0 on success, -1 if there is no such thread.
+ */
+int thread_join(int tid, int *status);
+
+/**
+ * End the calling thread. In the process's first thread,
+ * the same as exit(), ending all the threads.
+ * @param status Exit status for thread_join().
+ */
+void thread_exit(int status) __attribute__((noreturn));
\ No newline at end of file
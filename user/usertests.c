@@ -7,6 +7,9 @@
 #include "kernel/syscall.h"
 #include "kernel/memlayout.h"
 #include "kernel/riscv.h"
+#include "kernel/vm.h"
+#include "kernel/ioctl.h"
+#include "kernel/lockstat.h"
 
 //
 // Tests xv6 system calls.  usertests without arguments runs them all
@@ -789,6 +792,35 @@ pipe1(char *s)
 }
 
 
+// a read() from a pipe into a bad address must fail without
+// consuming the bytes it failed to copy out.
+void
+pipebadread(char *s)
+{
+  int fds[2];
+  char b[8];
+
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  if(write(fds[1], "hello", 5) != 5){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  if(read(fds[0], (char*)MAXVA, 5) != -1){
+    printf("%s: read to a bad address succeeded\n", s);
+    exit(1);
+  }
+  if(read(fds[0], b, sizeof(b)) != 5 || memcmp(b, "hello", 5) != 0){
+    printf("%s: pipe lost data after a bad read\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+}
+
+
 // test if child is killed (status = -1)
 void
 killstatus(char *s)
@@ -1921,12 +1953,13 @@ dirfile(char *s)
 
 // test that iput() is called at the end of _namei().
 // also tests empty file names.
+#define NIREF 51
 void
 iref(char *s)
 {
   int i, fd;
 
-  for(i = 0; i < NINODE + 1; i++){
+  for(i = 0; i < NIREF; i++){
     if(mkdir("irefd") != 0){
       printf("%s: mkdir irefd failed\n", s);
       exit(1);
@@ -1948,7 +1981,7 @@ iref(char *s)
   }
 
   // clean up
-  for(i = 0; i < NINODE + 1; i++){
+  for(i = 0; i < NIREF; i++){
     chdir("..");
     unlink("irefd");
   }
@@ -2698,6 +2731,955 @@ lazy_copy(char *s)
   exit(0);
 }
 
+// fork a process that uses more than half of physical memory,
+// which only works if fork shares pages copy-on-write, and check
+// that writes by parent and child are not visible to each other.
+void
+cowfork(char *s)
+{
+  uint64 sz = 80*1024*1024;
+  char *p, *q;
+  int pid, xstatus;
+
+  p = sbrk(sz);
+  if(p == (char*)SBRK_ERROR){
+    printf("%s: sbrk(%ld) failed\n", s, sz);
+    exit(1);
+  }
+  for(q = p; q < p + sz; q += PGSIZE)
+    *(int*)q = 1;
+
+  for(int i = 0; i < 3; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      for(q = p; q < p + sz; q += 8*PGSIZE){
+        if(*(int*)q != 1){
+          printf("%s: child saw parent's write\n", s);
+          exit(1);
+        }
+        *(int*)q = 2;
+      }
+      exit(0);
+    }
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(1);
+  }
+
+  for(q = p; q < p + sz; q += PGSIZE){
+    if(*(int*)q != 1){
+      printf("%s: parent saw child's write\n", s);
+      exit(1);
+    }
+  }
+  sbrk(-sz);
+}
+
+// grow the heap by several aligned megabytes, which the kernel
+// maps with 2-megabyte superpages, then shrink it to the middle
+// of one (splitting it), grow it again, and fork, checking the
+// contents each time.
+void
+sbrksuper(char *s)
+{
+  uint64 mb = 1024*1024;
+  char *p, *q, *top;
+  int pid, xstatus;
+
+  p = sbrk(0);
+  if(sbrk(2*mb - (uint64)p % (2*mb) + 8*mb) == (char*)SBRK_ERROR){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  top = sbrk(0);
+  for(q = p; q < top; q += PGSIZE)
+    *(uint64*)q = (uint64)q;
+
+  sbrk(-3*mb);
+  for(q = p; q < top - 3*mb; q += PGSIZE){
+    if(*(uint64*)q != (uint64)q){
+      printf("%s: wrong content after shrink\n", s);
+      exit(1);
+    }
+  }
+  if(sbrk(3*mb) == (char*)SBRK_ERROR){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(q = top - 3*mb; q < top; q += PGSIZE){
+    if(*(uint64*)q != 0){
+      printf("%s: new memory not zero\n", s);
+      exit(1);
+    }
+    *(uint64*)q = (uint64)q;
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(q = p; q < top; q += PGSIZE){
+      if(*(uint64*)q != (uint64)q){
+        printf("%s: child saw wrong content\n", s);
+        exit(1);
+      }
+      *(uint64*)q = 0;
+    }
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(1);
+  for(q = p; q < top; q += PGSIZE){
+    if(*(uint64*)q != (uint64)q){
+      printf("%s: parent saw child's write\n", s);
+      exit(1);
+    }
+  }
+  sbrk(-(top - p));
+}
+
+// getpid() and uptime() read the usyscall page; check them
+// against the system calls, in a parent and a child, and
+// check that the page is read-only.
+void
+usyscall(char *s)
+{
+  int pid, xstatus;
+
+  if(getpid() != sys_getpid()){
+    printf("%s: getpid() %d != %d\n", s, getpid(), sys_getpid());
+    exit(1);
+  }
+  int t0 = sys_uptime();
+  int t1 = uptime();
+  if(t1 < t0 - 1 || t1 > sys_uptime()){
+    printf("%s: uptime() %d, expected about %d\n", s, t1, t0);
+    exit(1);
+  }
+  if(((struct usyscall*)USYSCALL)->timebase == 0){
+    printf("%s: no timebase\n", s);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(getpid() != sys_getpid())
+      exit(1);
+    ((struct usyscall*)USYSCALL)->pid = 0;
+    exit(2);
+  }
+  wait(&xstatus);
+  if(xstatus != -1){
+    printf("%s: child status %d; usyscall page writable?\n", s, xstatus);
+    exit(1);
+  }
+}
+
+// scan lazily allocated heap memory in order, which makes
+// vmfault() map pages ahead, under each kind of madvise()
+// advice, and check that every page reads as zero and keeps
+// what is written to it.
+void
+lazyscan(char *s)
+{
+  int advice[] = { MADV_NORMAL, MADV_SEQUENTIAL, MADV_RANDOM, MADV_WILLNEED };
+  uint64 sz = 1024*1024;
+  char *p, *q;
+
+  for(int i = 0; i < sizeof(advice)/sizeof(advice[0]); i++){
+    p = sbrklazy(sz);
+    if(p == (char*)SBRK_ERROR){
+      printf("%s: sbrklazy failed\n", s);
+      exit(1);
+    }
+    q = (char*)PGROUNDUP((uint64)p);
+    if(madvise(q, p + sz - q, advice[i]) < 0){
+      printf("%s: madvise(%d) failed\n", s, advice[i]);
+      exit(1);
+    }
+    for(q = p; q < p + sz; q += PGSIZE/2){
+      if(*q != 0){
+        printf("%s: lazy page not zero\n", s);
+        exit(1);
+      }
+      *q = 'a' + i;
+    }
+    for(q = p; q < p + sz; q += PGSIZE/2){
+      if(*q != 'a' + i){
+        printf("%s: lost a write\n", s);
+        exit(1);
+      }
+    }
+    sbrk(-sz);
+  }
+
+  // the range must be in the heap or a mapping.
+  p = sbrk(0);
+  if(madvise((char*)PGROUNDUP((uint64)p), PGSIZE, MADV_WILLNEED) == 0){
+    printf("%s: madvise beyond the heap succeeded\n", s);
+    exit(1);
+  }
+}
+
+// usleep() sleeps at least as long as asked, and, since it
+// doesn't wait for clock ticks, not much longer: well under
+// the default 100ms tick.
+void
+usleeptest(char *s)
+{
+  enum { N = 10, USEC = 5000 };
+  uint64 t0, t, total = 0;
+
+  for(int i = 0; i < N; i++){
+    t0 = r_time();
+    if(usleep(USEC) != 0){
+      printf("%s: usleep failed\n", s);
+      exit(1);
+    }
+    t = r_time() - t0;
+    if(t < USEC * (TIMEBASE / 1000000)){
+      printf("%s: usleep(%d) returned after %d cycles\n", s, USEC, (int)t);
+      exit(1);
+    }
+    total += t;
+  }
+  if(total / N >= TIMEBASE / 20){
+    printf("%s: usleep(%d) took %d cycles on average\n", s, USEC, (int)(total / N));
+    exit(1);
+  }
+  if(usleep(0) != 0 || pause(0) != 0){
+    printf("%s: zero-length sleep failed\n", s);
+    exit(1);
+  }
+}
+
+// pin a process to one CPU and check that the mask sticks,
+// is inherited by fork, can be set by another process, and that
+// bad masks and pids are refused.
+void
+affinitytest(char *s)
+{
+  uint64 all, one, mask;
+  int pid, xstatus;
+
+  if(sched_getaffinity(0, &all) != 0 || all == 0){
+    printf("%s: sched_getaffinity failed\n", s);
+    exit(1);
+  }
+  one = all & -all;
+  if(sched_setaffinity(0, 0) != -1 || sched_setaffinity(0, 1L << 63) != -1 ||
+     sched_setaffinity(-1, all) != -1 || sched_getaffinity(-1, &mask) != -1){
+    printf("%s: bad sched_setaffinity succeeded\n", s);
+    exit(1);
+  }
+  if(sched_setaffinity(0, one) != 0 || sched_getaffinity(0, &mask) != 0 || mask != one){
+    printf("%s: sched_setaffinity(%d) did not stick\n", s, (int)one);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(sched_getaffinity(0, &mask) != 0 || mask != one)
+      exit(1);
+    // wait for the parent to move us, still making progress.
+    for(int i = 0; i < 100 && mask == one; i++){
+      pause(1);
+      if(sched_getaffinity(0, &mask) != 0)
+        exit(1);
+    }
+    exit(mask == all ? 0 : 2);
+  }
+  if(sched_setaffinity(pid, all) != 0){
+    printf("%s: sched_setaffinity(child) failed\n", s);
+    exit(1);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child saw the wrong mask (%d)\n", s, xstatus);
+    exit(1);
+  }
+  if(sched_setaffinity(0, all) != 0){
+    printf("%s: sched_setaffinity(all) failed\n", s);
+    exit(1);
+  }
+}
+
+// threads of one process: they share memory, sbrk() and open
+// files, join() collects their exit statuses, exec() from one
+// fails, and the first thread's exit() ends the others.
+enum { NTHR = 4, NSUM = 4096 };
+int thrdata[NSUM];
+uint64 thrsum[NTHR];
+volatile char *thrbrk;
+int thrfds[2];
+int threxec;
+
+void
+thrsumfn(void *arg)
+{
+  int i, me = (uint64)arg;
+
+  for(i = me; i < NSUM; i += NTHR)
+    thrsum[me] += thrdata[i];
+  thread_exit(10 + me);
+}
+
+void
+thrsysfn(void *arg)
+{
+  char *argv[] = { "echo", "x", 0 };
+
+  if((thrbrk = sbrk(PGSIZE)) != SBRK_ERROR)
+    thrbrk[0] = 'b';
+  if(pipe(thrfds) < 0)
+    thrfds[0] = -1;
+  threxec = exec("echo", argv);
+}
+
+void
+thrspinfn(void *arg)
+{
+  for(;;)
+    ;
+}
+
+void
+threadtest(char *s)
+{
+  int tid[NTHR], i, xstatus, pid;
+  uint64 sum = 0;
+  char c;
+
+  for(i = 0; i < NSUM; i++)
+    thrdata[i] = i;
+  for(i = 0; i < NTHR; i++){
+    if((tid[i] = thread_create(thrsumfn, (void*)(uint64)i)) < 0){
+      printf("%s: thread_create failed\n", s);
+      exit(1);
+    }
+  }
+  for(i = 0; i < NTHR; i++){
+    if(thread_join(tid[i], &xstatus) != 0 || xstatus != 10 + i){
+      printf("%s: thread_join(%d) failed\n", s, tid[i]);
+      exit(1);
+    }
+    sum += thrsum[i];
+  }
+  if(sum != (uint64)NSUM * (NSUM - 1) / 2){
+    printf("%s: threads summed to %d\n", s, (int)sum);
+    exit(1);
+  }
+  if(thread_join(tid[0], 0) != -1 || join(getpid(), 0) != -1){
+    printf("%s: join of a bad thread succeeded\n", s);
+    exit(1);
+  }
+
+  if((tid[0] = thread_create(thrsysfn, 0)) < 0 || thread_join(tid[0], 0) != 0){
+    printf("%s: thread_create failed\n", s);
+    exit(1);
+  }
+  if(thrbrk == SBRK_ERROR || thrbrk[0] != 'b'){
+    printf("%s: the thread's sbrk() isn't shared\n", s);
+    exit(1);
+  }
+  if(thrfds[0] < 0 || write(thrfds[1], "f", 1) != 1 || read(thrfds[0], &c, 1) != 1 || c != 'f'){
+    printf("%s: the thread's pipe isn't shared\n", s);
+    exit(1);
+  }
+  close(thrfds[0]);
+  close(thrfds[1]);
+  if(threxec != -1){
+    printf("%s: exec from a thread succeeded\n", s);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(thread_create(thrspinfn, 0) < 0)
+      exit(1);
+    pause(2);
+    exit(7);
+  }
+  wait(&xstatus);
+  if(xstatus != 7){
+    printf("%s: process with a spinning thread exited with %d\n", s, xstatus);
+    exit(1);
+  }
+}
+
+// futexes: futex_wait() sleeps only while the word holds the
+// value, mutexes and condition variables built on them work
+// between threads, and a futex in shared memory is found from
+// another process.
+enum { NLOCKERS = 4, NLOCKS = 2000, NITEMS = 100 };
+struct mutex ftxmutex;
+struct cond ftxcond;
+int ftxcount;
+int ftxitem, ftxfull;
+int ftxsum;
+
+void
+ftxlocker(void *arg)
+{
+  for(int i = 0; i < NLOCKS; i++){
+    mutex_lock(&ftxmutex);
+    ftxcount++;
+    mutex_unlock(&ftxmutex);
+  }
+}
+
+void
+ftxconsumer(void *arg)
+{
+  for(int i = 0; i < NITEMS; i++){
+    mutex_lock(&ftxmutex);
+    while(!ftxfull)
+      cond_wait(&ftxcond, &ftxmutex);
+    ftxsum += ftxitem;
+    ftxfull = 0;
+    cond_broadcast(&ftxcond);
+    mutex_unlock(&ftxmutex);
+  }
+}
+
+void
+futextest(char *s)
+{
+  int tid[NLOCKERS], i, w = 1, pid, xstatus, fds[2];
+  int *sw;
+
+  if(futex_wait(&w, 0) != -1 || futex_wake(&w, 1) != 0 ||
+     futex_wait((int*)((char*)&w + 1), 1) != -1 || futex_wake((int*)MAXVA, 1) != -1){
+    printf("%s: bad futex call succeeded\n", s);
+    exit(1);
+  }
+
+  mutex_init(&ftxmutex);
+  for(i = 0; i < NLOCKERS; i++){
+    if((tid[i] = thread_create(ftxlocker, 0)) < 0){
+      printf("%s: thread_create failed\n", s);
+      exit(1);
+    }
+  }
+  for(i = 0; i < NLOCKERS; i++)
+    thread_join(tid[i], 0);
+  if(ftxcount != NLOCKERS * NLOCKS){
+    printf("%s: mutex let through %d of %d increments\n", s, ftxcount, NLOCKERS * NLOCKS);
+    exit(1);
+  }
+  if(mutex_trylock(&ftxmutex) != 0 || mutex_trylock(&ftxmutex) != -1){
+    printf("%s: mutex_trylock wrong\n", s);
+    exit(1);
+  }
+  mutex_unlock(&ftxmutex);
+
+  // hand items one at a time to a consumer thread.
+  cond_init(&ftxcond);
+  if((tid[0] = thread_create(ftxconsumer, 0)) < 0){
+    printf("%s: thread_create failed\n", s);
+    exit(1);
+  }
+  for(i = 1; i <= NITEMS; i++){
+    mutex_lock(&ftxmutex);
+    while(ftxfull)
+      cond_wait(&ftxcond, &ftxmutex);
+    ftxitem = i;
+    ftxfull = 1;
+    cond_broadcast(&ftxcond);
+    mutex_unlock(&ftxmutex);
+  }
+  thread_join(tid[0], 0);
+  if(ftxsum != NITEMS * (NITEMS + 1) / 2){
+    printf("%s: consumer summed to %d\n", s, ftxsum);
+    exit(1);
+  }
+
+  // a fork while a thread waits makes the mutex's page
+  // copy-on-write, and unlocking it then moves the word to a
+  // new page; the waiter must still wake.
+  mutex_lock(&ftxmutex);
+  ftxcount = 0;
+  if((tid[0] = thread_create(ftxlocker, 0)) < 0){
+    printf("%s: thread_create failed\n", s);
+    exit(1);
+  }
+  while(__atomic_load_n(&ftxmutex.state, __ATOMIC_SEQ_CST) != 2)
+    pause(1);
+  pause(1);
+  if(pipe(fds) < 0 || (pid = fork()) < 0){
+    printf("%s: pipe or fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    // keep the page shared until the parent is done.
+    close(fds[1]);
+    read(fds[0], &xstatus, 1);
+    exit(0);
+  }
+  close(fds[0]);
+  mutex_unlock(&ftxmutex);
+  thread_join(tid[0], 0);
+  close(fds[1]);
+  wait(0);
+  if(ftxcount != NLOCKS){
+    printf("%s: waiter got %d of %d locks after fork\n", s, ftxcount, NLOCKS);
+    exit(1);
+  }
+
+  // a futex in shared memory, between processes.
+  if((sw = shmat(shmget(0x5a18, PGSIZE), 0)) == MAP_FAILED){
+    printf("%s: shmat failed\n", s);
+    exit(1);
+  }
+  *sw = 0;
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    while(__atomic_load_n(sw, __ATOMIC_SEQ_CST) == 0)
+      futex_wait(sw, 0);
+    exit(*sw);
+  }
+  pause(2);
+  __atomic_store_n(sw, 5, __ATOMIC_SEQ_CST);
+  futex_wake(sw, 1);
+  wait(&xstatus);
+  shmdt(sw);
+  if(xstatus != 5){
+    printf("%s: child waiting on a shared futex exited with %d\n", s, xstatus);
+    exit(1);
+  }
+}
+
+// the lockstat device has counts for the locks the kernel
+// uses, which LOCKSTAT_RESET zeroes.
+uint64
+lockstatsum(int fd, int *nproc)
+{
+  struct lockstat st;
+  uint64 sum = 0;
+
+  *nproc = 0;
+  while(read(fd, &st, sizeof(st)) == sizeof(st)){
+    if(strcmp(st.name, "proc") == 0)
+      *nproc = 1;
+    sum += st.acquire;
+  }
+  return sum;
+}
+
+void
+lockstattest(char *s)
+{
+  int fd, nproc;
+  uint64 before, after;
+
+  if((fd = open("/lockstat", O_RDONLY)) < 0){
+    printf("%s: cannot open /lockstat\n", s);
+    exit(1);
+  }
+  before = lockstatsum(fd, &nproc);
+  if(before == 0 || !nproc){
+    printf("%s: no counts for proc locks\n", s);
+    exit(1);
+  }
+  if(ioctl(fd, LOCKSTAT_RESET, 0) != 0){
+    printf("%s: reset failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  fd = open("/lockstat", O_RDONLY);
+  after = lockstatsum(fd, &nproc);
+  close(fd);
+  if(after >= before){
+    printf("%s: reset left %d of %d acquisitions\n", s, (int)after, (int)before);
+    exit(1);
+  }
+}
+
+// attach a shared memory segment in a parent and, through
+// fork and shmget(), a child, and check that they see each
+// other's writes and that the last detach frees the segment.
+void
+shmtest(char *s)
+{
+  enum { KEY = 0x5a17, N = 3*PGSIZE };
+  char *p, *q;
+  int id, pid, xstatus, i;
+
+  if((id = shmget(KEY, N)) < 0){
+    printf("%s: shmget failed\n", s);
+    exit(1);
+  }
+  if(shmget(KEY, N) != id || shmget(KEY, N + PGSIZE) != -1){
+    printf("%s: shmget didn't find the segment by key\n", s);
+    exit(1);
+  }
+  if((p = shmat(id, 0)) == MAP_FAILED){
+    printf("%s: shmat failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    if(p[i] != 0){
+      printf("%s: new segment not zeroed\n", s);
+      exit(1);
+    }
+  }
+  for(i = 0; i < N; i += PGSIZE)
+    p[i] = 'p';
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    // a second attachment, at an address of our choosing,
+    // maps the same pages as the one fork kept.
+    q = (char*)PGROUNDDOWN((uint64)p) - N - PGSIZE;
+    if(shmat(shmget(KEY, N), q) != q){
+      printf("%s: shmat at chosen address failed\n", s);
+      exit(1);
+    }
+    for(i = 0; i < N; i += PGSIZE){
+      if(q[i] != 'p'){
+        printf("%s: child sees 0x%x, not the parent's write\n", s, q[i]);
+        exit(1);
+      }
+      q[i] = 'c';
+      if(p[i] != 'c'){
+        printf("%s: attachments don't share pages\n", s);
+        exit(1);
+      }
+    }
+    if(shmdt(q) != 0 || shmdt(q) != -1){
+      printf("%s: shmdt wrong\n", s);
+      exit(1);
+    }
+    exit(0);   // exit detaches p
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(xstatus);
+  for(i = 0; i < N; i += PGSIZE){
+    if(p[i] != 'c'){
+      printf("%s: parent doesn't see child's write\n", s);
+      exit(1);
+    }
+  }
+
+  // the last detach frees the segment, so the key
+  // makes a fresh one.
+  if(shmdt(p) != 0){
+    printf("%s: shmdt failed\n", s);
+    exit(1);
+  }
+  if((id = shmget(KEY, PGSIZE)) < 0 || (p = shmat(id, 0)) == MAP_FAILED){
+    printf("%s: second shmget/shmat failed\n", s);
+    exit(1);
+  }
+  if(p[0] != 0){
+    printf("%s: segment outlived its last detach\n", s);
+    exit(1);
+  }
+  shmdt(p);
+
+  // a segment never attached stays until shmctl(IPC_RMID)
+  // removes it; then its key makes a new one, and removed
+  // segments' slots can be used again.
+  if((id = shmget(KEY, PGSIZE)) < 0 || shmget(KEY, PGSIZE) != id ||
+     shmctl(id, IPC_RMID) != 0 || shmctl(id, IPC_RMID) != -1 || shmctl(id, 1) != -1){
+    printf("%s: shmctl(IPC_RMID) failed\n", s);
+    exit(1);
+  }
+  if((id = shmget(KEY, 2*PGSIZE)) < 0 || shmctl(id, IPC_RMID) != 0){
+    printf("%s: removed key didn't make a new segment\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 2*NSHM; i++){
+    if((id = shmget(0, PGSIZE)) < 0 || shmctl(id, IPC_RMID) != 0){
+      printf("%s: removed segments kept their slots\n", s);
+      exit(1);
+    }
+  }
+}
+
+// mmap() a file private and shared, and anonymous memory,
+// and check what the file and a forked child see.
+void
+mmaptest(char *s)
+{
+  enum { N = 3*PGSIZE };
+  char *p;
+  int fd, i, pid, xstatus;
+
+  fd = open("mmapfile", O_CREATE|O_RDWR|O_TRUNC);
+  if(fd < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    buf[0] = 'a' + i % 26;
+    if(write(fd, buf, 1) != 1){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+
+  // private: writes stay in memory.
+  p = mmap(0, N, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(p == MAP_FAILED){
+    printf("%s: mmap private failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    if(p[i] != 'a' + i % 26){
+      printf("%s: wrong byte %d in private mapping\n", s, i);
+      exit(1);
+    }
+  }
+  p[0] = 'X';
+  if(munmap(p, N) != 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+
+  // shared: writes reach the file, including a child's.
+  p = mmap(0, N, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(p == MAP_FAILED){
+    printf("%s: mmap shared failed\n", s);
+    exit(1);
+  }
+  p[PGSIZE] = 'Y';
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(p[0] != 'a' || p[PGSIZE] != 'Y')
+      exit(1);
+    p[2*PGSIZE] = 'Z';
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child saw wrong shared data\n", s);
+    exit(1);
+  }
+  if(p[2*PGSIZE] != 'Z'){
+    printf("%s: child's write not shared\n", s);
+    exit(1);
+  }
+  if(munmap(p, N) != 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  fd = open("mmapfile", O_RDONLY);
+  if(read(fd, buf, 1) != 1 || buf[0] != 'a'){
+    printf("%s: private write reached the file\n", s);
+    exit(1);
+  }
+  for(i = 1; i < 3; i++){
+    buf[0] = 0;
+    if(read(fd, buf, PGSIZE - 1) != PGSIZE - 1 || read(fd, buf, 1) != 1 ||
+       buf[0] != "YZ"[i-1]){
+      printf("%s: shared write %d not in the file\n", s, i);
+      exit(1);
+    }
+  }
+  close(fd);
+  unlink("mmapfile");
+
+  // anonymous memory is zero, and can be unmapped piecewise.
+  p = mmap(0, N, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if(p == MAP_FAILED){
+    printf("%s: mmap anonymous failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    if(p[i] != 0){
+      printf("%s: anonymous memory not zero\n", s);
+      exit(1);
+    }
+  }
+  p[N-1] = 1;
+  if(munmap(p, PGSIZE) != 0 || munmap(p + PGSIZE, 2*PGSIZE) != 0){
+    printf("%s: munmap anonymous failed\n", s);
+    exit(1);
+  }
+}
+
+// write() a file mapping that hasn't been read in yet to a pipe,
+// and read() it into lazily allocated heap, so that the pipe's
+// copies have to fault pages in, reading the file.
+void
+pipemmap(char *s)
+{
+  enum { N = 3*PGSIZE };
+  char *p, *q;
+  int fd, fds[2], i, n, pid, xstatus;
+
+  fd = open("pipemmap", O_CREATE|O_RDWR|O_TRUNC);
+  if(fd < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++)
+    buf[i] = 'a' + i % 31;
+  if(write(fd, buf, N) != N){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  if((p = mmap(0, N, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("pipemmap");
+
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    close(fds[0]);
+    if(write(fds[1], p, N) != N)
+      exit(1);
+    exit(0);
+  }
+  close(fds[1]);
+  q = sbrklazy(N);
+  for(i = 0; i < N; i += n){
+    if((n = read(fds[0], q + i, N - i)) <= 0){
+      printf("%s: read returned %d after %d bytes\n", s, n, i);
+      exit(1);
+    }
+  }
+  close(fds[0]);
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: writer failed\n", s);
+    exit(1);
+  }
+  if(memcmp(p, q, N) != 0 || memcmp(q, buf, N) != 0){
+    printf("%s: pipe garbled the data\n", s);
+    exit(1);
+  }
+  munmap(p, N);
+  sbrk(-N);
+}
+
+// write() from, and read() into, mappings of the same file that
+// haven't been read in yet, so that the copies fault in the very
+// blocks being written or read.
+void
+mmapself(char *s)
+{
+  enum { N = 3*PGSIZE };
+  char *p, *q;
+  int fd, fd2, i;
+
+  fd = open("mmapself", O_CREATE|O_RDWR|O_TRUNC);
+  if(fd < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++)
+    buf[i] = 'a' + i % 29;
+  if(write(fd, buf, N) != N){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  fd = open("mmapself", O_RDWR);
+  if((p = mmap(0, N, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  if(write(fd, p, N) != N){
+    printf("%s: write from own mapping failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  munmap(p, N);
+
+  fd = open("mmapself", O_RDWR);
+  if((q = mmap(0, N, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED){
+    printf("%s: mmap shared failed\n", s);
+    exit(1);
+  }
+  if(read(fd, q, N) != N){
+    printf("%s: read into own mapping failed\n", s);
+    exit(1);
+  }
+  if(memcmp(q, buf, N) != 0){
+    printf("%s: read into own mapping garbled the data\n", s);
+    exit(1);
+  }
+  munmap(q, N);
+  close(fd);
+
+  // the fault during this write caches page 0 as it was
+  // before the write; a later mapping must not see that.
+  fd = open("mmapself", O_RDWR);
+  if(write(fd, "x", 1) != 1){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  if((p = mmap(0, N, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  if(write(fd, p, PGSIZE-1) != PGSIZE-1){
+    printf("%s: write from own mapping failed\n", s);
+    exit(1);
+  }
+  fd2 = open("mmapself", O_RDONLY);
+  if((q = mmap(0, N, PROT_READ, MAP_PRIVATE, fd2, 0)) == MAP_FAILED){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  if(q[0] != 'x' || q[1] != 'x' || memcmp(q+2, buf+1, PGSIZE-2) != 0){
+    printf("%s: mapping shows the file as it was before write()\n", s);
+    exit(1);
+  }
+  munmap(p, N);
+  munmap(q, N);
+  close(fd);
+  close(fd2);
+  unlink("mmapself");
+}
+
 struct test {
   void (*f)(char *);
   char *s;
@@ -2721,6 +3703,7 @@ struct test {
   {dirtest, "dirtest"},
   {exectest, "exectest"},
   {pipe1, "pipe1"},
+  {pipebadread, "pipebadread"},
   {killstatus, "killstatus"},
   {preempt, "preempt"},
   {exitwait, "exitwait"},
@@ -2765,6 +3748,19 @@ struct test {
   {lazy_alloc, "lazy_alloc"},
   {lazy_unmap, "lazy_unmap"},
   {lazy_copy, "lazy_copy"},
+  {cowfork, "cowfork"},
+  {sbrksuper, "sbrksuper"},
+  {usyscall, "usyscall"},
+  {lazyscan, "lazyscan"},
+  {shmtest, "shmtest"},
+  {usleeptest, "usleeptest"},
+  {affinitytest, "affinitytest"},
+  {threadtest, "threadtest"},
+  {futextest, "futextest"},
+  {lockstattest, "lockstattest"},
+  {mmaptest, "mmaptest"},
+  {pipemmap, "pipemmap"},
+  {mmapself, "mmapself"},
   { 0, 0},
 };
 
@@ -3053,6 +4049,33 @@ outofinodes(char *s)
   }
 }
 
+// allocate more memory than the machine has, which works only
+// by paging some of it out to swap, and check that every page
+// comes back with what was written to it.
+void
+swaptest(char *s)
+{
+  uint64 mb = 1024*1024, n;
+  char *p, *q;
+
+  p = sbrk(0);
+  for(n = 0; sbrk(mb) != SBRK_ERROR; n += mb){
+    for(q = p + n; q < p + n + mb; q += PGSIZE)
+      *(uint64*)q = (uint64)q;
+  }
+  if(n <= PHYSTOP - KERNBASE){
+    printf("%s: only %ld MB before sbrk failed\n", s, n / mb);
+    exit(1);
+  }
+  for(q = p; q < p + n; q += PGSIZE){
+    if(*(uint64*)q != (uint64)q){
+      printf("%s: wrong content at %p\n", s, q);
+      exit(1);
+    }
+  }
+  sbrk(-n);
+}
+
 struct test slowtests[] = {
   {bigdir, "bigdir"},
   {manywrites, "manywrites"},
@@ -3060,6 +4083,7 @@ struct test slowtests[] = {
   {execout, "execout"},
   {diskfull, "diskfull"},
   {outofinodes, "outofinodes"},
+  {swaptest, "swaptest"},
     
   { 0, 0},
 };
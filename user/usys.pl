@@ -9,7 +9,7 @@ print "#include \"kernel/syscall.h\"\n";
 sub entry {
     my $prefix = "sys_";
     my $name = shift;
-    if ($name eq "sbrk") {
+    if ($name eq "sbrk" || $name eq "getpid" || $name eq "uptime") {
 	print ".global $prefix$name\n";
 	print "$prefix$name:\n";
     } else {
@@ -43,3 +43,18 @@ entry("sbrk");
 entry("pause");
 entry("uptime");
 entry("ioctl");
+entry("mmap");
+entry("munmap");
+entry("madvise");
+entry("shmget");
+entry("shmat");
+entry("shmdt");
+entry("nice");
+entry("usleep");
+entry("sched_setaffinity");
+entry("sched_getaffinity");
+entry("clone");
+entry("join");
+entry("futex_wait");
+entry("futex_wake");
+entry("shmctl");